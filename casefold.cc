@@ -0,0 +1,78 @@
+// Generates casefold.h: the two-level lowercase mapping used by utf8::to_lower,
+// taken from the Unicode tables of the C library at build time.
+//
+// Codepoints are split into blocks of 256. Each block is stored as the
+// differences between the lowercase and the original codepoint, identical
+// blocks (most of them are all zeros) are stored once.
+#include <array>
+#include <clocale>
+#include <cstdio>
+#include <cwctype>
+#include <map>
+#include <vector>
+
+constexpr unsigned Block = 256;
+constexpr unsigned Blocks = 0x110000 / Block;
+
+unsigned encoded_length(unsigned c)
+{
+	return c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+}
+
+int main()
+{
+	if (!std::setlocale(LC_CTYPE, "C.UTF-8") && !std::setlocale(LC_CTYPE, "en_US.UTF-8")) {
+		std::fputs("casefold: no UTF-8 locale available\n", stderr);
+		return 1;
+	}
+
+	using Deltas = std::array<long, Block>;
+	std::vector<Deltas> blocks;
+	std::map<Deltas, unsigned> unique;
+	std::vector<unsigned> stage1;
+	unsigned mapped = 0;
+
+	for (unsigned b = 0; b < Blocks; ++b) {
+		Deltas deltas{};
+		for (unsigned i = 0; i < Block; ++i) {
+			unsigned c = b * Block + i;
+			if (c >= 0xd800 && c < 0xe000) continue;
+			unsigned lower = std::towlower(c);
+			if (lower == c) continue;
+
+			// utf8::lower_capacity relies on this
+			if (encoded_length(lower) > encoded_length(c) + (encoded_length(c) > 1)) {
+				std::fprintf(stderr, "casefold: U+%04X grows too much when lowercased\n", c);
+				return 1;
+			}
+			deltas[i] = long(lower) - long(c);
+			++mapped;
+		}
+
+		auto [it, inserted] = unique.try_emplace(deltas, blocks.size());
+		if (inserted) blocks.push_back(deltas);
+		stage1.push_back(it->second);
+	}
+
+	if (mapped < 1000) {
+		std::fputs("casefold: the C library has no full Unicode case mapping\n", stderr);
+		return 1;
+	}
+
+	std::printf("// Generated by casefold.cc, do not edit.\n");
+	std::printf("// %u codepoints with a lowercase mapping in %zu distinct blocks.\n", mapped, blocks.size());
+	std::printf("#pragma once\n\n#include <cstdint>\n\nnamespace utf8::casefold\n{\n");
+	std::printf("\tconstexpr std::uint%d_t stage1[%u] = {", blocks.size() <= 256 ? 8 : 16, Blocks);
+	for (unsigned b = 0; b < Blocks; ++b)
+		std::printf("%s%u,", b % 32 ? " " : "\n\t\t", stage1[b]);
+	std::printf("\n\t};\n\n");
+
+	std::printf("\tconstexpr std::int32_t stage2[%zu][%u] = {\n", blocks.size(), Block);
+	for (auto const& deltas : blocks) {
+		std::printf("\t\t{");
+		for (unsigned i = 0; i < Block; ++i)
+			std::printf("%s%ld,", i % 16 ? " " : "\n\t\t\t", deltas[i]);
+		std::printf("\n\t\t},\n");
+	}
+	std::printf("\t};\n}\n");
+}
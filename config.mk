@@ -12,21 +12,27 @@ X11LIB = /usr/X11R6/lib
 XINERAMALIBS  = -lXinerama
 XINERAMAFLAGS = -DXINERAMA
 
+# latency and matching statistics on stderr, uncomment to print them
+#STATSFLAGS = -DSTATS
+
 # freetype
 FREETYPELIBS = -lfontconfig -lXft
 FREETYPEINC = /usr/include/freetype2
 # OpenBSD (uncomment)
 #FREETYPEINC = $(X11INC)/freetype2
 
+# rules compiled into nlp-menu, comment to read ./wip.lisp at startup instead
+RULES = wip.lisp
+
 # includes and libs
 INCS = -I$(X11INC) -I$(FREETYPEINC) -I./lexy/include/
 LIBS = -L$(X11LIB) -lX11 $(XINERAMALIBS) $(FREETYPELIBS)
 
 # flags
-CPPFLAGS = -D_DEFAULT_SOURCE -D_BSD_SOURCE -D_XOPEN_SOURCE=700 -D_POSIX_C_SOURCE=200809L -DVERSION=\"$(VERSION)\" $(XINERAMAFLAGS) $(INCS)
-CFLAGS   = -std=c99 -pedantic -Wall $(CPPFLAGS) -O3
+CPPFLAGS = -D_DEFAULT_SOURCE -D_BSD_SOURCE -D_XOPEN_SOURCE=700 -D_POSIX_C_SOURCE=200809L -DVERSION=\"$(VERSION)\" $(XINERAMAFLAGS) $(STATSFLAGS) $(INCS)
+CFLAGS   = -std=c99 -pedantic -Wall -pthread $(CPPFLAGS) -O3
 CXXFLAGS =  -std=c++20 -Wall -Wextra $(CPPFLAGS) -O3
-LDFLAGS  = $(LIBS)
+LDFLAGS  = -pthread $(LIBS)
 
 # compiler and linker
 CC = cc
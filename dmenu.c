@@ -1,10 +1,17 @@
 /* See LICENSE file for copyright and license details. */
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <locale.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -26,13 +33,24 @@
                              * MAX(0, MIN((y)+(h),(r).y_org+(r).height) - MAX((y),(r).y_org)))
 #define LENGTH(X)             (sizeof X / sizeof X[0])
 #define TEXTW(X)              (drw_fontset_getwidth(drw, (X)) + lrpad)
+#define READBLOCK             (1 << 20) /* bytes read from stdin at once */
+#define BATCHITEMS            4096      /* lines handed to the main thread at once */
+#define SAMPLEEVERY           64        /* past the first batch, measure every n-th line */
 
 /* enums */
 enum { SchemeNorm, SchemeSel, SchemeOut, SchemeLast }; /* color schemes */
 
-struct item *items = NULL;
-struct item *prev, *curr, *next, *sel;
-struct item *matches, *matchend;
+/* lines read from stdin, handed over from the reader thread */
+struct batch {
+	size_t n;
+	struct item items[];
+};
+
+static struct item *items = NULL;
+static size_t nitems, itemcap;
+static int batchfd = -1; /* read end of the batch pipe, -1 when stdin is done */
+static size_t nmatches;              /* number of results of the last match */
+static size_t prev, curr, next, sel; /* indices into the results */
 
 static char text[BUFSIZ] = "";
 static char *embed;
@@ -40,6 +58,11 @@ static int bh, mw, mh;
 static int inputw = 0, promptw;
 static int lrpad; /* sum of left and right padding */
 static size_t cursor;
+static unsigned int matchgen; /* bumped whenever the matches change */
+static int matchpending; /* text changed, matches not updated yet */
+#ifdef STATS
+static unsigned long matchruns, matchskips;
+#endif
 static int mon = -1, screen;
 
 static Atom clip, utf8;
@@ -55,34 +78,25 @@ static Clr *scheme[SchemeLast];
 static int (*fstrncmp)(const char *, const char *, size_t) = strncmp;
 static char *(*fstrstr)(const char *, const char *) = strstr;
 
-static void
-appenditem(struct item *item, struct item **list, struct item **last)
-{
-	if (*last)
-		(*last)->right = item;
-	else
-		*list = item;
-
-	item->left = *last;
-	item->right = NULL;
-	*last = item;
-}
-
 static void
 calcoffsets(void)
 {
 	int i, n;
 
-	if (lines > 0)
-		n = lines * bh;
-	else
-		n = mw - (promptw + inputw + TEXTW("<") + TEXTW(">"));
-	/* calculate which items will begin the next page and previous page */
-	for (i = 0, next = curr; next; next = next->right)
-		if ((i += (lines > 0) ? bh : MIN(TEXTW(next->text), n)) > n)
+	if (lines > 0) {
+		/* every row has the same height, no need to look at the items */
+		next = MIN(curr + lines, nmatches);
+		prev = curr - MIN(curr, lines);
+		return;
+	}
+	n = mw - (promptw + inputw + TEXTW("<") + TEXTW(">"));
+	/* calculate which items will begin the next page and previous page,
+	 * measuring no more than a page of items in either direction */
+	for (i = 0, next = curr; next < nmatches; next++)
+		if ((i += MIN(TEXTW(result(next)->text), n)) > n)
 			break;
-	for (i = 0, prev = curr; prev && prev->left; prev = prev->left)
-		if ((i += (lines > 0) ? bh : MIN(TEXTW(prev->left->text), n)) > n)
+	for (i = 0, prev = curr; prev > 0; prev--)
+		if ((i += MIN(TEXTW(result(prev - 1)->text), n)) > n)
 			break;
 }
 
@@ -91,14 +105,28 @@ cleanup(void)
 {
 	size_t i;
 
+#ifdef STATS
+	if (matchskips)
+		fprintf(stderr, "Coalescing skipped %lu of %lu queries\n",
+		        matchskips, matchskips + matchruns);
+#endif
 	XUngrabKey(dpy, AnyKey, AnyModifier, root);
 	for (i = 0; i < SchemeLast; i++)
 		free(scheme[i]);
+	drw_fontcache_save(drw);
 	drw_free(drw);
 	XSync(dpy, False);
 	XCloseDisplay(dpy);
 }
 
+void
+hide(void)
+{
+	XUngrabKeyboard(dpy, CurrentTime);
+	XUnmapWindow(dpy, win);
+	XFlush(dpy);
+}
+
 static char *
 cistrstr(const char *s, const char *sub)
 {
@@ -111,23 +139,35 @@ cistrstr(const char *s, const char *sub)
 }
 
 static int
-drawitem(struct item *item, int x, int y, int w)
+drawitem(size_t item, int x, int y, int w)
 {
 	if (item == sel)
 		drw_setscheme(drw, scheme[SchemeSel]);
-	else if (item->out)
-		drw_setscheme(drw, scheme[SchemeOut]);
 	else
 		drw_setscheme(drw, scheme[SchemeNorm]);
 
-	return drw_text(drw, x, y, w, bh, lrpad / 2, item->text, 0);
+	return drw_text(drw, x, y, w, bh, lrpad / 2, result(item)->text, 0);
 }
 
 static void
-drawmenu(void)
+drawinput(int x, int w)
 {
 	unsigned int curpos;
-	struct item *item;
+
+	drw_setscheme(drw, scheme[SchemeNorm]);
+	drw_text(drw, x, 0, w, bh, lrpad / 2, text, 0);
+
+	curpos = TEXTW(text) - TEXTW(&text[cursor]);
+	if ((curpos += lrpad / 2 - 1) < w) {
+		drw_setscheme(drw, scheme[SchemeNorm]);
+		drw_rect(drw, x + curpos, 2, 2, bh - 4, 1, 0);
+	}
+}
+
+static void
+drawmenu(void)
+{
+	size_t item;
 	int x = 0, y = 0, w;
 
 	drw_setscheme(drw, scheme[SchemeNorm]);
@@ -138,32 +178,25 @@ drawmenu(void)
 		x = drw_text(drw, x, 0, promptw, bh, lrpad / 2, prompt, 0);
 	}
 	/* draw input field */
-	w = (lines > 0 || !matches) ? mw - x : inputw;
-	drw_setscheme(drw, scheme[SchemeNorm]);
-	drw_text(drw, x, 0, w, bh, lrpad / 2, text, 0);
-
-	curpos = TEXTW(text) - TEXTW(&text[cursor]);
-	if ((curpos += lrpad / 2 - 1) < w) {
-		drw_setscheme(drw, scheme[SchemeNorm]);
-		drw_rect(drw, x + curpos, 2, 2, bh - 4, 1, 0);
-	}
+	w = (lines > 0 || !nmatches) ? mw - x : inputw;
+	drawinput(x, w);
 
 	if (lines > 0) {
 		/* draw vertical list */
-		for (item = curr; item != next; item = item->right)
+		for (item = curr; item < next; item++)
 			drawitem(item, x, y += bh, mw - x);
-	} else if (matches) {
+	} else if (nmatches) {
 		/* draw horizontal list */
 		x += inputw;
 		w = TEXTW("<");
-		if (curr->left) {
+		if (curr > 0) {
 			drw_setscheme(drw, scheme[SchemeNorm]);
 			drw_text(drw, x, 0, w, bh, lrpad / 2, "<", 0);
 		}
 		x += w;
-		for (item = curr; item != next; item = item->right)
-			x = drawitem(item, x, 0, MIN(TEXTW(item->text), mw - x - TEXTW(">")));
-		if (next) {
+		for (item = curr; item < next; item++)
+			x = drawitem(item, x, 0, MIN(TEXTW(result(item)->text), mw - x - TEXTW(">")));
+		if (next < nmatches) {
 			w = TEXTW(">");
 			drw_setscheme(drw, scheme[SchemeNorm]);
 			drw_text(drw, mw - w, 0, w, bh, lrpad / 2, ">", 0);
@@ -172,6 +205,50 @@ drawmenu(void)
 	drw_map(drw, win, 0, 0, mw, mh);
 }
 
+/* Redraw only what changed since the last draw: the input field when the
+ * cursor moved, the list when the matches or the page changed, and the rows
+ * of the old and new selection when only the selection moved. The
+ * horizontal list is a single row, so it is always drawn whole. */
+static void
+drawchanges(void)
+{
+	static struct {
+		int valid;
+		unsigned int gen;
+		size_t cursor, curr, sel;
+	} drawn;
+	size_t item;
+	int x = (prompt && *prompt) ? promptw : 0, y;
+
+	if (!drawn.valid || lines == 0) {
+		drawmenu();
+	} else {
+		if (drawn.gen != matchgen || drawn.cursor != cursor) {
+			drawinput(x, mw - x);
+			drw_map(drw, win, x, 0, mw - x, bh);
+		}
+		if (drawn.gen != matchgen || drawn.curr != curr) {
+			drw_setscheme(drw, scheme[SchemeNorm]);
+			drw_rect(drw, x, bh, mw - x, mh - bh, 1, 1);
+			for (item = curr, y = 0; item < next; item++)
+				drawitem(item, x, y += bh, mw - x);
+			drw_map(drw, win, x, bh, mw - x, mh - bh);
+		} else if (drawn.sel != sel) {
+			for (item = curr, y = bh; item < next; item++, y += bh) {
+				if (item == sel || item == drawn.sel) {
+					drawitem(item, x, y, mw - x);
+					drw_map(drw, win, x, y, mw - x, bh);
+				}
+			}
+		}
+	}
+	drawn.valid = 1;
+	drawn.gen = matchgen;
+	drawn.cursor = cursor;
+	drawn.curr = curr;
+	drawn.sel = sel;
+}
+
 static void
 grabfocus(void)
 {
@@ -219,6 +296,12 @@ match(void)
 	struct item *item, *lprefix, *lsubstr, *prefixend, *substrend;
 
 	on_input_callback((char const*)text);
+	nmatches = result_count();
+	matchpending = 0;
+#ifdef STATS
+	matchruns++;
+#endif
+	curr = sel = 0;
 
 #if 0
 	strcpy(buf, text);
@@ -262,9 +345,30 @@ match(void)
 	}
 	curr = sel = matches;
 #endif
+	matchgen++;
 	calcoffsets();
 }
 
+/* Text edits only mark the matches stale. run() matches once the queued
+ * events are drained, so a burst of keys costs one query and one redraw;
+ * keys that act on the matches bring them up to date first. */
+static void
+requestmatch(void)
+{
+#ifdef STATS
+	if (matchpending)
+		matchskips++;
+#endif
+	matchpending = 1;
+}
+
+static void
+flushmatch(void)
+{
+	if (matchpending)
+		match();
+}
+
 static void
 insert(const char *str, ssize_t n)
 {
@@ -275,7 +379,7 @@ insert(const char *str, ssize_t n)
 	if (n > 0)
 		memcpy(&text[cursor], str, n);
 	cursor += n;
-	match();
+	requestmatch();
 }
 
 static size_t
@@ -344,7 +448,7 @@ keypress(XKeyEvent *ev)
 
 		case XK_k: /* delete right */
 			text[cursor] = '\0';
-			match();
+			requestmatch();
 			break;
 		case XK_u: /* delete left */
 			insert(NULL, 0 - cursor);
@@ -415,36 +519,40 @@ insert:
 		break;
 	case XK_End:
 	case XK_KP_End:
+		flushmatch();
 		if (text[cursor] != '\0') {
 			cursor = strlen(text);
 			break;
 		}
-		if (next) {
+		if (next < nmatches) {
 			/* jump to end of list and position items in reverse */
-			curr = matchend;
+			curr = nmatches - 1;
 			calcoffsets();
 			curr = prev;
 			calcoffsets();
-			while (next && (curr = curr->right))
+			while (next < nmatches && ++curr)
 				calcoffsets();
 		}
-		sel = matchend;
+		if (nmatches)
+			sel = nmatches - 1;
 		break;
 	case XK_Escape:
 		cleanup();
 		exit(1);
 	case XK_Home:
 	case XK_KP_Home:
-		if (sel == matches) {
+		flushmatch();
+		if (sel == 0) {
 			cursor = 0;
 			break;
 		}
-		sel = curr = matches;
+		sel = curr = 0;
 		calcoffsets();
 		break;
 	case XK_Left:
 	case XK_KP_Left:
-		if (cursor > 0 && (!sel || !sel->left || lines > 0)) {
+		flushmatch();
+		if (cursor > 0 && (!nmatches || sel == 0 || lines > 0)) {
 			cursor = nextrune(-1);
 			break;
 		}
@@ -453,31 +561,36 @@ insert:
 		/* fallthrough */
 	case XK_Up:
 	case XK_KP_Up:
-		if (sel && sel->left && (sel = sel->left)->right == curr) {
+		flushmatch();
+		if (nmatches && sel > 0 && sel-- == curr) {
 			curr = prev;
 			calcoffsets();
 		}
 		break;
 	case XK_Next:
 	case XK_KP_Next:
-		if (!next)
+		flushmatch();
+		if (next == nmatches)
 			return;
 		sel = curr = next;
 		calcoffsets();
 		break;
 	case XK_Prior:
 	case XK_KP_Prior:
-		if (!prev)
+		flushmatch();
+		if (!nmatches)
 			return;
 		sel = curr = prev;
 		calcoffsets();
 		break;
 	case XK_Return:
 	case XK_KP_Enter:
-		choose();
+		flushmatch();
+		choose(nmatches ? result(sel) : NULL);
 		break;
 	case XK_Right:
 	case XK_KP_Right:
+		flushmatch();
 		if (text[cursor] != '\0') {
 			cursor = nextrune(+1);
 			break;
@@ -487,23 +600,26 @@ insert:
 		/* fallthrough */
 	case XK_Down:
 	case XK_KP_Down:
-		if (sel && sel->right && (sel = sel->right) == next) {
+		flushmatch();
+		if (nmatches && sel + 1 < nmatches && ++sel == next) {
 			curr = next;
 			calcoffsets();
 		}
 		break;
 	case XK_Tab:
-		if (!sel)
+		flushmatch();
+		if (!nmatches)
 			return;
-		strncpy(text, sel->text, sizeof text - 1);
+		strncpy(text, result(sel)->text, sizeof text - 1);
 		text[sizeof text - 1] = '\0';
 		cursor = strlen(text);
-		match();
+		requestmatch();
 		break;
 	}
 
 draw:
-	drawmenu();
+	if (!matchpending)
+		drawchanges();
 }
 
 static void
@@ -521,46 +637,215 @@ paste(void)
 		insert(p, (q = strchr(p, '\n')) ? q - p : (ssize_t)strlen(p));
 		XFree(p);
 	}
+}
+
+static void
+sendbatch(int fd, struct batch **b)
+{
+	if (!*b)
+		return;
+	if (write(fd, b, sizeof *b) != sizeof *b)
+		die("write:");
+	*b = NULL;
+}
+
+static void
+addline(int fd, struct batch **b, char *line, size_t len)
+{
+	if (!*b)
+		*b = ecalloc(1, sizeof **b + BATCHITEMS * sizeof (*b)->items[0]);
+	(*b)->items[(*b)->n].text = line;
+	(*b)->items[(*b)->n++].len = len;
+	if ((*b)->n == BATCHITEMS)
+		sendbatch(fd, b);
+}
+
+/* adds the lines of [p, end), returns the rest no newline ends yet */
+static char *
+splitlines(int fd, struct batch **b, char *p, char *end)
+{
+	char *nl;
+
+	for (; (nl = memchr(p, '\n', end - p)); p = nl + 1)
+		addline(fd, b, p, nl - p);
+	return p;
+}
+
+/* Reads stdin on its own thread so the menu shows up at once. Items point
+ * into what was read and are not terminated, the byte after each one stays
+ * readable. A regular file is mapped and never written, so none of its pages
+ * is copied. Anything else is read in large blocks that stay allocated for
+ * as long as the items point into them, only a line cut at the end of a
+ * block is copied to the next one. */
+static void *
+reader(void *arg)
+{
+	int fd = (intptr_t)arg;
+	struct batch *b = NULL;
+	struct stat st;
+	char *buf, *line;
+	size_t cap = READBLOCK, len = 0, rest;
+	ssize_t n;
+
+	if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+	    (buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+	                STDIN_FILENO, 0)) != MAP_FAILED) {
+		madvise(buf, st.st_size, MADV_SEQUENTIAL);
+		line = splitlines(fd, &b, buf, buf + st.st_size);
+		if (line < buf + st.st_size) {
+			/* the mapping may end right after it */
+			rest = buf + st.st_size - line;
+			addline(fd, &b, memcpy(ecalloc(rest + 1, 1), line, rest), rest);
+		}
+		sendbatch(fd, &b);
+		close(fd);
+		return NULL;
+	}
+
+	buf = ecalloc(cap, 1);
+	for (line = buf;;) {
+		if (len == cap) {
+			rest = buf + len - line;
+			if (line == buf) {
+				/* one line fills the whole block, nothing points into it yet */
+				if (!(buf = realloc(buf, cap *= 2)))
+					die("cannot realloc %zu bytes:", cap);
+			} else {
+				cap = MAX(READBLOCK, 2 * rest);
+				buf = memcpy(ecalloc(cap, 1), line, rest);
+			}
+			line = buf;
+			len = rest;
+		}
+		if ((n = read(STDIN_FILENO, buf + len, cap - len)) < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		len += n;
+		line = splitlines(fd, &b, line, buf + len);
+	}
+	if (line < buf + len) {
+		rest = buf + len - line;
+		if (len == cap)
+			line = memcpy(ecalloc(rest + 1, 1), line, rest);
+		line[rest] = '\0';
+		addline(fd, &b, line, rest);
+	}
+	sendbatch(fd, &b);
+	close(fd);
+	return NULL;
+}
+
+/* Once stdin is read the vertical menu is no taller than its lines. The
+ * window opened before the count was known, a bottom bar keeps its bottom
+ * edge in place. */
+static void
+fitlines(void)
+{
+	XWindowAttributes wa;
+	int h;
+
+	if (lines <= nitems)
+		return;
+	lines = nitems;
+	h = (lines + 1) * bh;
+	if (XGetWindowAttributes(dpy, win, &wa))
+		XMoveResizeWindow(dpy, win, wa.x, topbar ? wa.y : wa.y + mh - h, mw, h);
+	mh = h;
+	drw_resize(drw, mw, mh);
+	calcoffsets();
 	drawmenu();
 }
 
+/* appends batches the reader finished, until the pipe is empty */
 static void
-readstdin(void)
+takebatches(void)
 {
-	char buf[sizeof text], *p;
-	size_t i, imax = 0, size = 0;
-	unsigned int tmpmax = 0;
-
-	stdin = freopen("/dev/null", "r", stdin);
-
-	/* read each line from stdin and add it to the item list */
-	for (i = 0; fgets(buf, sizeof buf, stdin); i++) {
-		if (i + 1 >= size / sizeof *items)
-			if (!(items = realloc(items, (size += BUFSIZ))))
-				die("cannot realloc %u bytes:", size);
-		if ((p = strchr(buf, '\n')))
-			*p = '\0';
-		if (!(items[i].text = strdup(buf)))
-			die("cannot strdup %u bytes:", strlen(buf) + 1);
-		items[i].out = 0;
-		drw_font_getexts(drw->fonts, buf, strlen(buf), &tmpmax, NULL);
-		if (tmpmax > inputw) {
-			inputw = tmpmax;
-			imax = i;
+	struct batch *b;
+	ssize_t n;
+	size_t i, first = nitems;
+	unsigned int w;
+
+	while ((n = read(batchfd, &b, sizeof b)) == sizeof b) {
+		if (nitems + b->n + 1 > itemcap) {
+			itemcap = MAX(2 * itemcap, nitems + b->n + 1);
+			if (!(items = realloc(items, itemcap * sizeof *items)))
+				die("cannot realloc %zu items:", itemcap);
+		}
+		/* measuring a million lines would cost more than reading them */
+		for (i = 0; i < b->n; i++, nitems++) {
+			items[nitems] = b->items[i];
+			if (nitems < BATCHITEMS || nitems % SAMPLEEVERY == 0) {
+				drw_font_getexts(drw->fonts, items[nitems].text, items[nitems].len, &w, NULL);
+				inputw = MAX(inputw, w + lrpad);
+			}
 		}
+		items[nitems].text = NULL;
+		free(b);
 	}
-	if (items)
-		items[i].text = NULL;
-	inputw = items ? TEXTW(items[imax].text) : 0;
-	lines = MIN(lines, i);
+	if (n == 0) {
+		close(batchfd);
+		batchfd = -1;
+		fitlines();
+	}
+	if (nitems == first)
+		return;
+
+	/* only the new lines are matched, the selection stays where it is;
+	 * a pending edit matches them along with the rest anyway */
+	add_stdin(&items[first], nitems - first);
+	if (matchpending)
+		return;
+	nmatches = extend_results();
+	matchgen++;
+	calcoffsets();
+	drawchanges();
+}
+
+static void
+readstdin(void)
+{
+	pthread_t thread;
+	int fds[2];
+
+	if (isatty(STDIN_FILENO))
+		return;
+	if (pipe(fds) < 0)
+		die("pipe:");
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	batchfd = fds[0];
+	if (pthread_create(&thread, NULL, reader, (void *)(intptr_t)fds[1]))
+		die("cannot create stdin reader thread");
+	pthread_detach(thread);
 }
 
 static void
 run(void)
 {
 	XEvent ev;
+	fd_set fds;
+	int xfd = ConnectionNumber(dpy);
+
+	for (;;) {
+		/* events already queued by Xlib would not wake select up */
+		if (!XPending(dpy)) {
+			if (matchpending) {
+				match();
+				drawchanges();
+				continue;
+			}
+			FD_ZERO(&fds);
+			FD_SET(xfd, &fds);
+			if (batchfd >= 0)
+				FD_SET(batchfd, &fds);
+			if (select(MAX(xfd, batchfd) + 1, &fds, NULL, NULL, NULL) < 0 && errno != EINTR)
+				die("select:");
+			if (batchfd >= 0 && FD_ISSET(batchfd, &fds))
+				takebatches();
+			continue;
+		}
 
-	while (!XNextEvent(dpy, &ev)) {
+		XNextEvent(dpy, &ev);
 		if (XFilterEvent(&ev, win))
 			continue;
 		switch(ev.type) {
@@ -691,7 +976,7 @@ setup(void)
 		grabfocus();
 	}
 	drw_resize(drw, mw, mh);
-	drawmenu();
+	drawchanges();
 }
 
 static void
@@ -706,6 +991,7 @@ int
 main(int argc, char *argv[])
 {
 	XWindowAttributes wa;
+	char *path;
 	int i, fast = 0;
 	lines = 5;
 
@@ -760,9 +1046,21 @@ main(int argc, char *argv[])
 	if (!drw_fontset_create(drw, fonts, LENGTH(fonts)))
 		die("no fonts could be loaded.");
 	lrpad = drw->fonts->h;
+	if ((path = cachepath("fonts"))) {
+		drw_fontcache_load(drw, path);
+		free(path);
+	}
+	if ((path = cachepath("usage"))) {
+		load_usage(path);
+		free(path);
+	}
+	if ((path = cachepath("path"))) {
+		set_path_cache(path);
+		free(path);
+	}
 
 #ifdef __OpenBSD__
-	if (pledge("stdio rpath", NULL) == -1)
+	if (pledge("stdio rpath wpath cpath", NULL) == -1)
 		die("pledge");
 #endif
 
@@ -71,6 +71,8 @@ drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h
 	drw->w = w;
 	drw->h = h;
 	drw->drawable = XCreatePixmap(dpy, root, w, h, DefaultDepth(dpy, screen));
+	drw->xftdraw = XftDrawCreate(dpy, drw->drawable, DefaultVisual(dpy, screen),
+	                             DefaultColormap(dpy, screen));
 	drw->gc = XCreateGC(dpy, root, 0, NULL);
 	XSetLineAttributes(dpy, drw->gc, 1, LineSolid, CapButt, JoinMiter);
 
@@ -88,14 +90,38 @@ drw_resize(Drw *drw, unsigned int w, unsigned int h)
 	if (drw->drawable)
 		XFreePixmap(drw->dpy, drw->drawable);
 	drw->drawable = XCreatePixmap(drw->dpy, drw->root, w, h, DefaultDepth(drw->dpy, drw->screen));
+	XftDrawChange(drw->xftdraw, drw->drawable);
+}
+
+static void
+drw_cache_clear(Drw *drw)
+{
+	size_t i;
+
+	for (i = 0; i < GLYPH_PAGES; i++) {
+		free(drw->glyphs[i]);
+		drw->glyphs[i] = NULL;
+	}
+	for (i = 0; i < TEXTW_SLOTS; i++) {
+		free(drw->textw[i].text);
+		drw->textw[i].text = NULL;
+	}
+	for (i = 0; i < drw->nfallbacks; i++)
+		free(drw->fallbacks[i].name);
+	free(drw->fallbacks);
+	drw->fallbacks = NULL;
+	drw->nfallbacks = 0;
 }
 
 void
 drw_free(Drw *drw)
 {
+	XftDrawDestroy(drw->xftdraw);
 	XFreePixmap(drw->dpy, drw->drawable);
 	XFreeGC(drw->dpy, drw->gc);
+	drw_cache_clear(drw);
 	drw_fontset_free(drw->fonts);
+	free(drw->fontcache);
 	free(drw);
 }
 
@@ -225,8 +251,10 @@ drw_scm_create(Drw *drw, const char *clrnames[], size_t clrcount)
 void
 drw_setfontset(Drw *drw, Fnt *set)
 {
-	if (drw)
+	if (drw) {
+		drw_cache_clear(drw);
 		drw->fonts = set;
+	}
 }
 
 void
@@ -248,23 +276,195 @@ drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int
 		XDrawRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w - 1, h - 1);
 }
 
+static void
+xfont_append(Drw *drw, Fnt *font)
+{
+	Fnt *curfont;
+
+	for (curfont = drw->fonts; curfont->next; curfont = curfont->next)
+		; /* NOP */
+	curfont->next = font;
+}
+
+/* Name a font by its pattern, leaving out the charset and language list:
+ * they are large and Xft recomputes them when the font is opened. The
+ * caller has to call free(3) on the returned name. */
+static char *
+xfont_name(FcPattern *pattern)
+{
+	FcPattern *p;
+	FcChar8 *name;
+
+	p = FcPatternDuplicate(pattern);
+	FcPatternDel(p, FC_CHARSET);
+	FcPatternDel(p, FC_LANG);
+	name = FcNameUnparse(p);
+	FcPatternDestroy(p);
+	return (char *)name;
+}
+
+/* Fall back to fontconfig for a codepoint that no loaded font contains.
+ * A font found this way is appended to the set, so later lookups of this
+ * or any other codepoint it covers are answered by the glyph cache. */
+static Fnt *
+xfont_fallback(Drw *drw, long utf8codepoint)
+{
+	Fnt *usedfont = NULL;
+	FcCharSet *fccharset;
+	FcPattern *fcpattern;
+	FcPattern *match;
+	XftResult result;
+
+	fccharset = FcCharSetCreate();
+	FcCharSetAddChar(fccharset, utf8codepoint);
+
+	if (!drw->fonts->pattern) {
+		/* Refer to the comment in xfont_create for more information. */
+		die("the first font in the cache must be loaded from a font string.");
+	}
+
+	fcpattern = FcPatternDuplicate(drw->fonts->pattern);
+	FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
+	FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
+	FcPatternAddBool(fcpattern, FC_COLOR, FcFalse);
+
+	FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
+	FcDefaultSubstitute(fcpattern);
+	match = XftFontMatch(drw->dpy, drw->screen, fcpattern, &result);
+
+	FcCharSetDestroy(fccharset);
+	FcPatternDestroy(fcpattern);
+
+	if (match) {
+		usedfont = xfont_create(drw, NULL, match);
+		if (usedfont && XftCharExists(drw->dpy, usedfont->xfont, utf8codepoint)) {
+			xfont_append(drw, usedfont);
+		} else {
+			xfont_free(usedfont);
+			usedfont = NULL;
+		}
+	}
+	return usedfont;
+}
+
+static int
+fallback_index(Drw *drw, char *name)
+{
+	size_t i;
+
+	for (i = 0; i < drw->nfallbacks; i++) {
+		if (!strcmp(drw->fallbacks[i].name, name)) {
+			free(name);
+			return i;
+		}
+	}
+	if (!(drw->fallbacks = realloc(drw->fallbacks, (i + 1) * sizeof(Fallback))))
+		die("cannot realloc %u bytes:", (i + 1) * sizeof(Fallback));
+	drw->fallbacks[i].name = name;
+	drw->fallbacks[i].font = NULL;
+	drw->fallbacks[i].gone = 0;
+	drw->nfallbacks++;
+	return i;
+}
+
+/* Open a fallback font remembered from an earlier run. Returns NULL if the
+ * font is gone or no longer has the glyph. */
+static Fnt *
+fallback_open(Drw *drw, Fallback *fb, long utf8codepoint)
+{
+	FcPattern *pattern;
+
+	if (fb->gone)
+		return NULL;
+	if (!fb->font) {
+		if (!(pattern = FcNameParse((FcChar8 *)fb->name))
+		|| !(fb->font = xfont_create(drw, NULL, pattern))) {
+			fb->gone = 1;
+			return NULL;
+		}
+		xfont_append(drw, fb->font);
+	}
+	return XftCharExists(drw->dpy, fb->font->xfont, utf8codepoint) ? fb->font : NULL;
+}
+
+static unsigned int
+glyph_advance(Fnt *font, long utf8codepoint)
+{
+	XGlyphInfo ext;
+	FcChar32 c = utf8codepoint;
+
+	XftTextExtents32(font->dpy, font->xfont, &c, 1, &ext);
+	return ext.xOff;
+}
+
+static Glyf *
+glyph_slot(Drw *drw, long utf8codepoint)
+{
+	Glyf **page = &drw->glyphs[utf8codepoint / GLYPH_PAGE];
+
+	if (!*page)
+		*page = ecalloc(GLYPH_PAGE, sizeof(Glyf));
+	return &(*page)[utf8codepoint % GLYPH_PAGE];
+}
+
+/* Resolve the font drawing a codepoint and its advance. Every answer is
+ * cached, including codepoints no font has, so Xft and fontconfig are
+ * queried once per codepoint instead of on every draw. */
+static Glyf
+drw_glyph(Drw *drw, long utf8codepoint)
+{
+	Glyf *g = glyph_slot(drw, utf8codepoint);
+	Fnt *curfont;
+	int i;
+
+	if (g->font)
+		return *g;
+
+	for (curfont = drw->fonts; curfont; curfont = curfont->next)
+		if (XftCharExists(drw->dpy, curfont->xfont, utf8codepoint))
+			break;
+	if (!curfont && g->fallback > 0
+	&& !(curfont = fallback_open(drw, &drw->fallbacks[g->fallback - 1], utf8codepoint)))
+		g->fallback = 0; /* stale, ask fontconfig again */
+	/* fonts earlier runs fell back to often cover neighbouring codepoints
+	 * too, try the ones not opened yet before asking fontconfig */
+	for (i = 0; !curfont && !g->fallback && i < (int)drw->nfallbacks; i++) {
+		if (!drw->fallbacks[i].font
+		&& (curfont = fallback_open(drw, &drw->fallbacks[i], utf8codepoint))) {
+			g->fallback = i + 1;
+			drw->fontcachedirty = 1;
+		}
+	}
+	if (!curfont && !g->fallback) {
+		if ((curfont = xfont_fallback(drw, utf8codepoint))) {
+			i = fallback_index(drw, xfont_name(curfont->xfont->pattern));
+			drw->fallbacks[i].font = curfont;
+			g->fallback = i + 1;
+			drw->fontcachedirty = 1;
+		} else {
+			g->fallback = -1;
+		}
+	}
+
+	/* Regardless of whether or not a fallback font is found, the
+	 * character must be drawn. */
+	g->font = curfont ? curfont : drw->fonts;
+	g->w = glyph_advance(g->font, utf8codepoint);
+	return *g;
+}
+
 int
 drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert)
 {
 	char buf[1024];
 	int ty;
 	unsigned int ew;
-	XftDraw *d = NULL;
-	Fnt *usedfont, *curfont, *nextfont;
+	Fnt *usedfont;
+	Glyf g;
 	size_t i, len;
-	int utf8strlen, utf8charlen, render = x || y || w || h;
+	int utf8charlen, render = x || y || w || h, overflow = 0;
 	long utf8codepoint = 0;
 	const char *utf8str;
-	FcCharSet *fccharset;
-	FcPattern *fcpattern;
-	FcPattern *match;
-	XftResult result;
-	int charexists = 0;
 
 	if (!drw || (render && !drw->scheme) || !text || !drw->fonts)
 		return 0;
@@ -274,107 +474,49 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 	} else {
 		XSetForeground(drw->dpy, drw->gc, drw->scheme[invert ? ColFg : ColBg].pixel);
 		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
-		d = XftDrawCreate(drw->dpy, drw->drawable,
-		                  DefaultVisual(drw->dpy, drw->screen),
-		                  DefaultColormap(drw->dpy, drw->screen));
 		x += lpad;
 		w -= lpad;
 	}
 
-	usedfont = drw->fonts;
-	while (1) {
-		utf8strlen = 0;
+	while (*text && !overflow) {
+		/* take the longest run of characters drawn with the same font,
+		 * summing cached advances until the text no longer fits */
+		usedfont = NULL;
 		utf8str = text;
-		nextfont = NULL;
+		len = 0;
+		ew = 0;
 		while (*text) {
 			utf8charlen = utf8decode(text, &utf8codepoint, UTF_SIZ);
-			for (curfont = drw->fonts; curfont; curfont = curfont->next) {
-				charexists = charexists || XftCharExists(drw->dpy, curfont->xfont, utf8codepoint);
-				if (charexists) {
-					if (curfont == usedfont) {
-						utf8strlen += utf8charlen;
-						text += utf8charlen;
-					} else {
-						nextfont = curfont;
-					}
-					break;
-				}
-			}
-
-			if (!charexists || nextfont)
+			g = drw_glyph(drw, utf8codepoint);
+			if ((usedfont && g.font != usedfont) || len + utf8charlen >= sizeof(buf))
+				break;
+			if (ew + g.w > w) {
+				overflow = 1;
 				break;
-			else
-				charexists = 0;
-		}
-
-		if (utf8strlen) {
-			drw_font_getexts(usedfont, utf8str, utf8strlen, &ew, NULL);
-			/* shorten text if necessary */
-			for (len = MIN(utf8strlen, sizeof(buf) - 1); len && ew > w; len--)
-				drw_font_getexts(usedfont, utf8str, len, &ew, NULL);
-
-			if (len) {
-				memcpy(buf, utf8str, len);
-				buf[len] = '\0';
-				if (len < utf8strlen)
-					for (i = len; i && i > len - 3; buf[--i] = '.')
-						; /* NOP */
-
-				if (render) {
-					ty = y + (h - usedfont->h) / 2 + usedfont->xfont->ascent;
-					XftDrawStringUtf8(d, &drw->scheme[invert ? ColBg : ColFg],
-					                  usedfont->xfont, x, ty, (XftChar8 *)buf, len);
-				}
-				x += ew;
-				w -= ew;
 			}
+			usedfont = g.font;
+			len += utf8charlen;
+			text += utf8charlen;
+			ew += g.w;
 		}
 
-		if (!*text) {
-			break;
-		} else if (nextfont) {
-			charexists = 0;
-			usedfont = nextfont;
-		} else {
-			/* Regardless of whether or not a fallback font is found, the
-			 * character must be drawn. */
-			charexists = 1;
-
-			fccharset = FcCharSetCreate();
-			FcCharSetAddChar(fccharset, utf8codepoint);
-
-			if (!drw->fonts->pattern) {
-				/* Refer to the comment in xfont_create for more information. */
-				die("the first font in the cache must be loaded from a font string.");
-			}
-
-			fcpattern = FcPatternDuplicate(drw->fonts->pattern);
-			FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
-			FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
-			FcPatternAddBool(fcpattern, FC_COLOR, FcFalse);
-
-			FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
-			FcDefaultSubstitute(fcpattern);
-			match = XftFontMatch(drw->dpy, drw->screen, fcpattern, &result);
-
-			FcCharSetDestroy(fccharset);
-			FcPatternDestroy(fcpattern);
-
-			if (match) {
-				usedfont = xfont_create(drw, NULL, match);
-				if (usedfont && XftCharExists(drw->dpy, usedfont->xfont, utf8codepoint)) {
-					for (curfont = drw->fonts; curfont->next; curfont = curfont->next)
-						; /* NOP */
-					curfont->next = usedfont;
-				} else {
-					xfont_free(usedfont);
-					usedfont = drw->fonts;
-				}
+		if (len) {
+			memcpy(buf, utf8str, len);
+			buf[len] = '\0';
+			/* shorten text if necessary */
+			if (overflow)
+				for (i = len; i && i > len - 3; buf[--i] = '.')
+					; /* NOP */
+
+			if (render) {
+				ty = y + (h - usedfont->h) / 2 + usedfont->xfont->ascent;
+				XftDrawStringUtf8(drw->xftdraw, &drw->scheme[invert ? ColBg : ColFg],
+				                  usedfont->xfont, x, ty, (XftChar8 *)buf, len);
 			}
+			x += ew;
+			w -= ew;
 		}
 	}
-	if (d)
-		XftDrawDestroy(d);
 
 	return x + (render ? w : 0);
 }
@@ -386,15 +528,29 @@ drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h)
 		return;
 
 	XCopyArea(drw->dpy, drw->drawable, win, drw->gc, x, y, w, h, x, y);
-	XSync(drw->dpy, False);
+	XFlush(drw->dpy);
 }
 
 unsigned int
 drw_fontset_getwidth(Drw *drw, const char *text)
 {
+	TextW *tw;
+	unsigned long hash = 5381;
+	const char *p;
+
 	if (!drw || !drw->fonts || !text)
 		return 0;
-	return drw_text(drw, 0, 0, 0, 0, 0, text, 0);
+
+	for (p = text; *p; p++)
+		hash = hash * 33 ^ (unsigned char)*p;
+	tw = &drw->textw[hash % TEXTW_SLOTS];
+	if (tw->text && !strcmp(tw->text, text))
+		return tw->w;
+
+	free(tw->text);
+	if (!(tw->text = strdup(text)))
+		die("cannot strdup %u bytes:", strlen(text) + 1);
+	return (tw->w = drw_text(drw, 0, 0, 0, 0, 0, text, 0));
 }
 
 void
@@ -412,6 +568,78 @@ drw_font_getexts(Fnt *font, const char *text, unsigned int len, unsigned int *w,
 		*h = font->h;
 }
 
+/* The fallback choices of fontconfig only hold for the primary font they
+ * were made for, which is recorded on the first line of the file. Glyphs no
+ * font had are not kept, a font installed later may have them. */
+void
+drw_fontcache_load(Drw *drw, const char *path)
+{
+	FILE *fp;
+	char *line = NULL, *primary, *p;
+	size_t size = 0;
+	ssize_t n;
+	long cp;
+
+	if (!drw || !drw->fonts || !path)
+		return;
+	free(drw->fontcache);
+	if (!(drw->fontcache = strdup(path)))
+		die("cannot strdup %u bytes:", strlen(path) + 1);
+	if (!(fp = fopen(path, "r")))
+		return;
+
+	primary = xfont_name(drw->fonts->pattern);
+	if ((n = getline(&line, &size, fp)) > 0 && line[n - 1] == '\n')
+		line[n - 1] = '\0';
+	if (n > 0 && !strcmp(line, primary)) {
+		while ((n = getline(&line, &size, fp)) > 0) {
+			if (line[n - 1] == '\n')
+				line[n - 1] = '\0';
+			cp = strtol(line, &p, 16);
+			if (p == line || *p++ != ' ' || !BETWEEN(cp, 0, 0x10FFFF))
+				continue;
+			if (strcmp(p, "-") && (p = strdup(p)))
+				glyph_slot(drw, cp)->fallback = fallback_index(drw, p) + 1;
+		}
+	}
+	free(primary);
+	free(line);
+	fclose(fp);
+}
+
+void
+drw_fontcache_save(Drw *drw)
+{
+	FILE *fp;
+	char *tmp, *primary;
+	size_t i, j;
+	Glyf *g;
+
+	if (!drw || !drw->fonts || !drw->fontcache || !drw->fontcachedirty)
+		return;
+
+	tmp = ecalloc(strlen(drw->fontcache) + 5, 1);
+	sprintf(tmp, "%s.tmp", drw->fontcache);
+	if (!(fp = fopen(tmp, "w"))) {
+		free(tmp);
+		return;
+	}
+	primary = xfont_name(drw->fonts->pattern);
+	fprintf(fp, "%s\n", primary);
+	for (i = 0; i < GLYPH_PAGES; i++)
+		for (j = 0; drw->glyphs[i] && j < GLYPH_PAGE; j++)
+			if ((g = &drw->glyphs[i][j])->fallback > 0)
+				fprintf(fp, "%lx %s\n", (unsigned long)(i * GLYPH_PAGE + j),
+				        drw->fallbacks[g->fallback - 1].name);
+	if (fclose(fp) == 0)
+		rename(tmp, drw->fontcache);
+	else
+		remove(tmp);
+	drw->fontcachedirty = 0;
+	free(primary);
+	free(tmp);
+}
+
 Cur *
 drw_cur_create(Drw *drw, int shape)
 {
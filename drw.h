@@ -15,15 +15,43 @@ typedef struct Fnt {
 enum { ColFg, ColBg }; /* Clr scheme index */
 typedef XftColor Clr;
 
+#define GLYPH_PAGE   256
+#define GLYPH_PAGES  (0x110000 / GLYPH_PAGE)
+#define TEXTW_SLOTS  1024
+
+typedef struct {
+	Fnt *font;      /* first font of the set containing the glyph, NULL if unresolved */
+	unsigned int w; /* advance of the glyph in that font */
+	int fallback;   /* 1 + index into Drw fallbacks, -1 if no font has it, 0 if unknown */
+} Glyf;
+
+typedef struct {
+	char *name;     /* unparsed fontconfig pattern */
+	Fnt *font;      /* opened on first use */
+	int gone;       /* could not be opened, not tried again */
+} Fallback;
+
+typedef struct {
+	char *text;
+	unsigned int w;
+} TextW;
+
 typedef struct {
 	unsigned int w, h;
 	Display *dpy;
 	int screen;
 	Window root;
 	Drawable drawable;
+	XftDraw *xftdraw;
 	GC gc;
 	Clr *scheme;
 	Fnt *fonts;
+	Glyf *glyphs[GLYPH_PAGES]; /* codepoint -> glyph cache, allocated per page */
+	TextW textw[TEXTW_SLOTS];   /* string -> width cache, direct mapped */
+	Fallback *fallbacks;        /* fallback fonts found by fontconfig */
+	size_t nfallbacks;
+	char *fontcache;            /* file the fallback choices persist in */
+	int fontcachedirty;
 } Drw;
 
 /* Drawable abstraction */
@@ -36,6 +64,8 @@ Fnt *drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount);
 void drw_fontset_free(Fnt* set);
 unsigned int drw_fontset_getwidth(Drw *drw, const char *text);
 void drw_font_getexts(Fnt *font, const char *text, unsigned int len, unsigned int *w, unsigned int *h);
+void drw_fontcache_load(Drw *drw, const char *path);
+void drw_fontcache_save(Drw *drw);
 
 /* Colorscheme abstraction */
 void drw_clr_create(Drw *drw, Clr *dest, const char *clrname);
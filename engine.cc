@@ -2,6 +2,7 @@
 
 #include <cassert>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <mutex>
 #include <string_view>
@@ -11,51 +12,193 @@
 #include <mutex>
 #include <atomic>
 
+#include <fcntl.h>
+#include <spawn.h>
 #include <sys/wait.h>
 #include <unistd.h>
-#include <regex>
 #include <chrono>
 
 #include "lisp.cc"
-#include "unicode.cc"
+#ifdef Compiled_Rules
+#include "rules.gen.cc"
+#endif
 
 namespace chrono = std::chrono;
 
-void fill_items(std::vector<std::pair<std::string, Match const*>>& sugg)
+lisp::Value rules, implicit_rules;
+Suggestion_Tree tree;
+std::once_flag tree_initialized;
+
+// Results of the last query. Display text is resolved on first access,
+// either pointing into the tree or into result_texts.
+std::vector<item> results;
+Arena result_texts;
+
+Match *root = nullptr;
+
+#ifdef STATS
+// Start of the process, for the startup to exec latency
+auto const started = chrono::steady_clock::now();
+#endif
+
+// Last input as typed and the nodes it walked through, slot values point into it
+std::string query;
+std::vector<Binding> path;
+
+// Typed tokens of the last input that slot validators were run on
+std::vector<std::string_view> slot_inputs;
+
+// Bumped whenever what a query resolves to may change: the tree was built
+// or stdin brought more lines
+std::uint64_t generation = 0;
+
+// Candidate nodes the last query listed lines of and the tokens those lines
+// had to contain, so lines read after it are matched alone instead of
+// running the whole query again
+struct Stdin_Match
 {
-	items = (struct item *)realloc(items, sizeof(struct item) * sugg.size());
+	std::vector<Match const*> nodes;
+	std::vector<std::pair<std::string, bool>> tokens; // text, ascii
+	std::size_t seen = 0;
 
-	for (auto i = 0u; i < sugg.size(); ++i) {
-		items[i].text = sugg[i].first.data();
-		items[i].left = i == 0 ? nullptr : &items[i-1];
-		items[i].right = i == sugg.size()-1 ? nullptr : &items[i+1];
-		items[i].out = 0;
+	bool contains(Candidate const& line) const
+	{
+		for (auto const& [text, ascii] : tokens)
+			if (line.key_for(ascii).find(text) == std::string::npos)
+				return false;
+		return true;
 	}
+};
+Stdin_Match stdin_match;
+
+// Recently resolved queries by their lowercase form, so backspacing to an
+// earlier query does not walk the tree again. Slot values are kept as token
+// positions. Validators are case sensitive, so an entry only serves a query
+// whose tokens they saw are typed the same.
+struct Query_Cache
+{
+	static constexpr std::size_t Max_Entries = 64;
+	static constexpr std::size_t Max_Items = 1 << 20;
 
-	if (sugg.empty()) {
-		sel = curr = matches = items = matchend = nullptr;
-	} else {
-		sel = curr = matches = items;
-		matchend = items + sugg.size();
-		prev = nullptr;
-		next = items->right;
+	struct Entry
+	{
+		std::string key;
+		std::vector<item> results;
+		std::vector<std::pair<Match const*, int>> path;
+		std::vector<std::pair<int, std::string>> slot_inputs;
+		Stdin_Match stdin_match;
+	};
+
+	std::list<Entry> entries;
+	std::unordered_map<std::string_view, std::list<Entry>::iterator> by_key;
+	std::size_t items = 0;
+	std::uint64_t generation = 0;
+
+	// Index of the token of query starting at token, -1 if there is none
+	static int position(std::string_view query, std::string_view token)
+	{
+		int i = 0;
+		if (!token.empty())
+			for (auto [t, rest] = utf8::split_at_ws(query); !t.empty(); std::tie(t, rest) = utf8::split_at_ws(rest), ++i)
+				if (t.data() == token.data()) return i;
+		return -1;
 	}
-}
 
-lisp::Value rules;
-Suggestion_Tree tree;
-std::once_flag tree_initialized;
-std::vector<std::pair<std::string, Match const*>> suggestions;
+	static std::string_view token_at(std::string_view query, int position)
+	{
+		std::string_view text, rest = query;
+		for (int i = 0; i <= position; ++i) std::tie(text, rest) = utf8::split_at_ws(rest);
+		return text;
+	}
 
-Match *root = nullptr;
+	Entry const* find(std::string const& key, std::string_view query)
+	{
+		if (generation != ::generation) clear();
+		auto it = by_key.find(key);
+		if (it == by_key.end()) return nullptr;
+		for (auto const& [token, text] : it->second->slot_inputs)
+			if (token_at(query, token) != text) return nullptr;
+		entries.splice(entries.begin(), entries, it->second);
+		return &entries.front();
+	}
+
+	void put(std::string key, std::vector<item> const& results, std::vector<Binding> const& path, std::string_view query)
+	{
+		if (generation != ::generation) clear();
+		if (results.size() > Max_Items) return;
+		// Same lowercase form with other slot tokens replaces the entry
+		if (auto it = by_key.find(key); it != by_key.end()) erase(it->second);
+
+		auto &entry = entries.emplace_front(Entry{ std::move(key), results, {}, {}, stdin_match });
+		for (auto const& binding : path)
+			entry.path.emplace_back(binding.node, position(query, binding.text));
+		for (auto text : slot_inputs)
+			if (auto const token = position(query, text); entry.slot_inputs.empty() || entry.slot_inputs.back().first != token)
+				entry.slot_inputs.emplace_back(token, text);
+		by_key.emplace(entry.key, entries.begin());
+		items += results.size();
+
+		while (entries.size() > Max_Entries || items > Max_Items)
+			erase(std::prev(entries.end()));
+	}
+
+	void erase(std::list<Entry>::iterator it)
+	{
+		items -= it->results.size();
+		by_key.erase(it->key);
+		entries.erase(it);
+	}
+
+	void clear()
+	{
+		entries.clear();
+		by_key.clear();
+		items = 0;
+		generation = ::generation;
+	}
+};
+
+Query_Cache query_cache;
+
+// Validator state of every slot after the token it was last fed. A token
+// that grew by a keystroke only feeds the new bytes, and one the automaton
+// already rejected stays rejected without looking at them.
+struct Slot_Progress
+{
+	std::string fed;
+	Dfa::State state;
+};
+std::unordered_map<Match const*, Slot_Progress> slot_progress;
+
+bool slot_accepts(Match const* slot, Pattern const& pattern, std::string_view token)
+{
+	auto &progress = slot_progress.try_emplace(slot, Slot_Progress{ {}, pattern.dfa->start }).first->second;
+	if (!token.starts_with(progress.fed)) progress = { {}, pattern.dfa->start };
+	progress.state = pattern.dfa->run(token.substr(progress.fed.size()), progress.state);
+	progress.fed = token;
+	return pattern.dfa->accepts(progress.state);
+}
+
+// Whether the last token of the input was ended by whitespace
+bool last_token_ended(std::string_view input)
+{
+	return !input.empty() && std::isspace(static_cast<unsigned char>(input.back()));
+}
 
 void on_input(std::string_view sv)
 {
-	std::string lowercase = utf8::to_lower(trim(sv));
+	bool const ended = last_token_ended(sv);
+	query = trim(sv);
+	std::string lowercase = utf8::to_lower(query);
 	sv = lowercase;
 
 	std::call_once(tree_initialized, [] {
+#ifdef STATS
 		auto start = chrono::system_clock::now();
+#endif
+#ifdef Compiled_Rules
+		tree.load(compiled::rules);
+#else
 		std::ifstream stream("./wip.lisp");
 		std::string file{std::istreambuf_iterator<char>(stream), {}};
 		std::string_view code{file};
@@ -70,127 +213,410 @@ void on_input(std::string_view sv)
 		}
 
 		tree.eval(rules);
+#endif
+
+		// Without a rule for stdin its lines are a plain dmenu list
+		if (!stdin_used) {
+			std::string_view implicit = "(do (action ((stdin)) (print last)))";
+			implicit_rules = lisp::read(implicit);
+			tree.eval(implicit_rules);
+		}
+
 		tree.optimize();
-		auto end = chrono::system_clock::now();
+		++generation;
 
-		std::cout << "LISP initialization took " << chrono::duration_cast<chrono::milliseconds>(end - start).count() << "ms" << std::endl;
+#ifdef STATS
+		auto end = chrono::system_clock::now();
+		std::cerr << "LISP initialization took " << chrono::duration_cast<chrono::milliseconds>(end - start).count() << "ms" << std::endl;
+#endif
 	});
 
-	suggestions.clear();
+	results.clear();
+	result_texts.clear();
+	path.clear();
 	root = &tree;
+	stdin_match = { {}, {}, stdin_lines.lines.size() };
+	slot_inputs.clear();
 
-	std::vector<std::string_view> substrings_to_match;
+	// Earlier tokens of the query, all of which have to be in a filename
+	struct Token { std::string_view text; bool ascii; };
+	std::vector<Token> substrings_to_match;
 
-	std::string_view next = sv;
+	// Lowercasing keeps whitespace in place, so the typed text is split in
+	// lockstep with the lowercase one
+	std::string_view next = sv, raw, raw_next = query;
 outer:
 	for (;;) {
 		// Skip empty nodes
-		while (std::get_if<std::monostate>(root) && root->next.size() == 1) root = root->next.front().get();
+		while (std::get_if<std::monostate>(root) && root->next.size() == 1 && std::get_if<std::monostate>(root->next.front().get()))
+			root = root->next.front().get();
 
 		std::tie(sv, next) = utf8::split_at_ws(next);
+		std::tie(raw, raw_next) = utf8::split_at_ws(raw_next);
+		auto const stripped = utf8::strip_diacritics(sv);
+		auto const lemma = stem::stem(stripped);
+		bool const ascii = stripped == sv;
 		if (sv.empty()) {
+			// Fully typed action can be run as is
+			if (root->command && !path.empty())
+				results.push_back({ nullptr, root, 0 });
+
 			// TODO Walk tree to get good subset of suggestions
 			for (auto const& c : root->next) {
 				auto var = c.get();
-
-				if (auto x = std::get_if<std::string>(var)) {
-					suggestions.push_back({ *x, var });
-					continue;
-				}
-
-				if (auto x = std::get_if<fs::path>(var)) {
-					suggestions.push_back({ x->filename().string(), var });
-					continue;
+				if (std::get_if<std::string>(var) || std::get_if<File>(var))
+					results.push_back({ nullptr, var, 0 });
+				if (auto x = std::get_if<Candidates>(var)) {
+					for (auto const& line : x->list->lines)
+						results.push_back({ line.text.data(), var, line.text.size() });
+					stdin_match.nodes.push_back(var);
 				}
 			}
-			return fill_items(suggestions);
+			return;
 		}
 
-		for (auto const& c : root->next) {
-			auto var = c.get();
-
-			if (auto x = std::get_if<fs::path>(var)) {
-				auto fname = utf8::to_lower(x->filename().string());
-
-				for (auto substr : substrings_to_match)
-					if (fname.find(substr) == std::string::npos)
-						goto skip_path;
+		// Slots are tried only when no keyword takes the token, the first one
+		// whose validator accepts it consumes it
+		Match *slot = nullptr;
+		bool completes_keyword = false;
+
+		// Filenames and candidate lines have to contain every token
+		auto const contains_tokens = [&](auto const& entry) {
+			for (auto substr : substrings_to_match)
+				if (entry.key_for(substr.ascii).find(substr.text) == std::string::npos)
+					return false;
+			return entry.key_for(ascii).find(sv) != std::string::npos;
+		};
+
+		// Filenames and lines are only collected for the last token, any
+		// earlier one either descends or clears the results anyway
+		bool const last_token = next.empty();
+
+		// An inflected form is only taken for a keyword once the token is
+		// complete, while it is typed it has to be a prefix like any other
+		bool const completed = !last_token || ended;
+
+		// Tokens of three bytes or more narrow the filenames and lines down
+		// through trigram indexes, the rest is verified by contains_tokens
+		std::vector<std::string_view> tokens;
+		for (auto substr : substrings_to_match) tokens.push_back(substr.text);
+		tokens.push_back(sv);
+
+		std::vector<Match*> children;
+		auto const hits = last_token && root->trigrams ? root->trigrams->candidates(tokens) : std::nullopt;
+		if (root->trigrams && (hits || !last_token)) {
+			for (auto i : root->unindexed) children.push_back(root->next[i].get());
+			if (hits) for (auto i : *hits) children.push_back(root->next[i].get());
+		} else {
+			for (auto const& c : root->next) children.push_back(c.get());
+		}
 
-				if (fname.find(sv) != std::string::npos) {
-					suggestions.push_back({ fname, var });
-					continue;
-				}
+		for (auto var : children) {
+			if (std::get_if<File>(var)) {
+				if (last_token && contains_tokens(*var))
+					results.push_back({ nullptr, var, 0 });
+				continue;
 			}
-skip_path:
-
-			if (auto x = std::get_if<std::string>(var)) {
-				auto [g, e] = std::mismatch(x->begin(), x->end(), sv.begin(), sv.end());
 
-				if (g == x->begin() && e == sv.begin())
-					continue;
-
-				if (g != x->cend() && e == sv.end()) {
-					suggestions.push_back({ *x, var });
-					continue;
+			if (auto x = std::get_if<Candidates>(var)) {
+				if (!last_token) continue;
+				auto const& lines = x->list->lines;
+				if (auto hits = x->list->index.candidates(tokens)) {
+					for (auto i : *hits)
+						if (contains_tokens(lines[i]))
+							results.push_back({ lines[i].text.data(), var, lines[i].text.size() });
+				} else {
+					for (auto const& line : lines)
+						if (contains_tokens(line))
+							results.push_back({ line.text.data(), var, line.text.size() });
+				}
+				if (stdin_match.nodes.empty()) {
+					for (auto substr : substrings_to_match) stdin_match.tokens.emplace_back(substr.text, substr.ascii);
+					stdin_match.tokens.emplace_back(sv, ascii);
 				}
+				stdin_match.nodes.push_back(var);
+				continue;
+			}
 
-				if (g == x->cend() && e == sv.end()) {
-					root = c.get();
+			if (std::get_if<std::string>(var)) {
+				bool typed = completed && var->lemma == lemma, prefix = false;
+				var->for_each_key(ascii, [&](std::string_view x) {
+					auto [g, e] = std::mismatch(x.begin(), x.end(), sv.begin(), sv.end());
+					if (e != sv.end()) return;
+					if (g == x.end()) typed = true;
+					else prefix = true;
+				});
+
+				if (typed) {
+					root = var;
+					path.push_back({ root, {} });
 					goto outer;
 				}
-
-				if (g == x->cend() && e != sv.end()) {
-					error("0 1 not implemented yet");
+				if (prefix) {
+					results.push_back({ nullptr, var, 0 });
+					completes_keyword = true;
 				}
+				continue;
+			}
+
+			if (auto x = std::get_if<Pattern>(var); x && !slot) {
+				slot_inputs.push_back(raw);
+				if (slot_accepts(var, *x, raw)) slot = var;
+			}
+		}
+
+		if (slot) {
+			results.clear();
+			stdin_match = { {}, {}, stdin_match.seen };
+			root = slot;
+			path.push_back({ root, raw });
+			goto outer;
+		}
+
+		// Keyword typed with a typo: an earlier token descends into the closest
+		// one, the last one suggests keywords starting close to it
+		if (auto const typos = Keyword_Trie::budget(sv); root->keywords && typos && !completes_keyword) {
+			auto const hits = root->keywords->search(sv, typos, last_token);
+			if (!last_token && !hits.empty()) {
+				results.clear();
+				stdin_match = { {}, {}, stdin_match.seen };
+				root = root->next[hits.front().id].get();
+				path.push_back({ root, {} });
+				goto outer;
 			}
+			for (auto hit : hits)
+				results.push_back({ nullptr, root->next[hit.id].get(), 0 });
 		}
 
 		if (!next.empty()) {
-			suggestions.clear();
-			substrings_to_match.push_back(sv);
+			results.clear();
+			substrings_to_match.push_back({ sv, ascii });
 			goto outer;
 		}
 
-		return fill_items(suggestions);
+		return;
+	}
+}
+
+// Usage key of a suggestion: values bound along the path to its parent,
+// followed by its own value. Values enter by their hash, so ranking a file
+// neither locks the file table nor builds its path.
+std::uint64_t usage_key(std::uint64_t parent, Binding const& binding)
+{
+	auto const value = Match::value_hash(binding);
+	return usage::hash({ reinterpret_cast<char const*>(&value), sizeof value }, parent);
+}
+
+// What a result binds at its rule position
+Binding binding_of(item const& result)
+{
+	auto match = static_cast<Match const*>(result.match);
+	if (!path.empty() && path.back().node == match) return path.back();
+	if (std::get_if<Candidates>(match)) return { match, { result.text, result.len } };
+	return { match, {} };
+}
+
+std::uint64_t usage_key(item const& result)
+{
+	auto const binding = binding_of(result);
+	auto parent = usage::hash({});
+	for (auto const& b : path)
+		if (b.node != binding.node) parent = usage_key(parent, b);
+	return usage_key(parent, binding);
+}
+
+// Moves frequently and recently chosen results to the front, keeping the
+// order of the tree among equally scored ones. Only results from from on
+// are ranked, among themselves: lines appended while the menu is shown
+// never move the ones it already shows.
+void rank_results(std::size_t from = 0)
+{
+	if (usage::scores.empty() || results.size() < from + 2) return;
+
+	auto grandparent = usage::hash({}), parent = grandparent;
+	for (auto const& binding : path) {
+		grandparent = parent;
+		parent = usage_key(parent, binding);
 	}
+
+	auto const score_of = [&](item const& result) {
+		auto const binding = binding_of(result);
+		return usage::score(!path.empty() && path.back().node == binding.node
+			? usage_key(grandparent, binding)
+			: usage_key(parent, binding));
+	};
+
+	bool scored = false;
+	for (auto i = from; i < results.size() && !scored; ++i) scored = score_of(results[i]) > 0;
+	if (!scored) return;
+
+	std::vector<std::pair<float, std::size_t>> ranked;
+	ranked.reserve(results.size() - from);
+	for (auto i = from; i < results.size(); ++i) ranked.emplace_back(-score_of(results[i]), i);
+
+	std::stable_sort(ranked.begin(), ranked.end(), [](auto const& a, auto const& b) { return a.first < b.first; });
+	std::vector<item> sorted;
+	sorted.reserve(ranked.size());
+	for (auto [_, i] : ranked) sorted.push_back(results[i]);
+	std::copy(sorted.begin(), sorted.end(), results.begin() + from);
 }
 
 extern "C"
 {
 	void on_input_callback(char const* s)
 	{
-		on_input(s);
+		auto key = utf8::to_lower(trim(s));
+		if (last_token_ended(s)) key += ' ';
+		if (auto hit = query_cache.find(key, trim(s))) {
+			query = trim(s);
+			results = hit->results;
+			stdin_match = hit->stdin_match;
+			result_texts.clear();
+			path.clear();
+			for (auto [node, token] : hit->path)
+				path.push_back({ node, Query_Cache::token_at(query, token) });
+			return;
+		}
+
+		// Building the tree on the first input is where rules can fail
+		try {
+			on_input(s);
+		} catch (std::exception const& e) {
+			fail(e);
+		}
+		rank_results();
+		query_cache.put(std::move(key), results, path, query);
 	}
 
-	void choose()
+	void add_stdin(struct item const* items, size_t n)
 	{
-		if (!sel) {
-			cleanup();
-			exit(1);
+		for (size_t i = 0; i < n; ++i)
+			stdin_lines.add({ items[i].text, items[i].len });
+		if (n) ++generation;
+	}
+
+	void load_usage(char const* path)
+	{
+		usage::load(path);
+	}
+
+	void set_path_cache(char const* path)
+	{
+		path_cache = path;
+	}
+
+	size_t extend_results()
+	{
+		auto const from = results.size();
+		for (auto node : stdin_match.nodes) {
+			auto const& lines = std::get_if<Candidates>(node)->list->lines;
+			for (auto i = stdin_match.seen; i < lines.size(); ++i)
+				if (stdin_match.contains(lines[i]))
+					results.push_back({ lines[i].text.data(), node, lines[i].text.size() });
 		}
+		stdin_match.seen = stdin_lines.lines.size();
+		rank_results(from);
+		return results.size();
+	}
+
+	size_t result_count()
+	{
+		return results.size();
+	}
 
-		auto found = std::find_if(suggestions.begin(), suggestions.end(), [](auto const& el) {
-			return el.first.data() == sel->text; });
+	struct item const* result(size_t i)
+	{
+		auto &r = results[i];
+		if (!r.text) {
+			auto match = static_cast<Match const*>(r.match);
+			if (auto x = std::get_if<std::string>(match))
+				r.text = x->c_str();
+			else if (auto x = std::get_if<File>(match))
+				r.text = x->name.data();
+			else if (std::get_if<Pattern>(match) && !path.empty() && path.back().node == match)
+				r.text = result_texts.store(path.back().text);
+		} else if (std::get_if<Candidates>(static_cast<Match const*>(r.match)) && r.text[r.len] != '\0') {
+			// Lines from stdin end in a newline, only the shown ones are copied
+			r.text = result_texts.store({ r.text, r.len });
+		}
+		return &r;
+	}
 
-		assert(found != suggestions.end());
-		assert(found->second->command);
-		auto command = found->second->eval();
+	void choose(struct item const* selected)
+	{
+		if (!selected) {
+			cleanup();
+			exit(1);
+		}
 
-		int pipe[2];
-		::pipe(pipe);
+		// Menu leaves the screen at once, everything that does not affect the
+		// command (usage log, font cache, X teardown) runs after it started
+#ifdef STATS
+		auto const enter = chrono::steady_clock::now();
+#endif
+		hide();
+
+		auto match = static_cast<Match const*>(selected->match);
+		assert(match->command);
+		auto bindings = path;
+		if (bindings.empty() || bindings.back().node != match)
+			bindings.push_back(binding_of(*selected));
+		std::vector<std::string> command;
+		try {
+			command = match->eval(std::move(bindings));
+		} catch (std::exception const& e) {
+			fail(e);
+		}
+		// Rules with empty commands are refused when the tree is built
+		if (command.empty()) {
+			std::cerr << "nlp-menu: empty command" << std::endl;
+			cleanup();
+			exit(1);
+		}
 
-		close(STDIN_FILENO);
-		dup2(pipe[0], STDIN_FILENO);
-		close(pipe[0]);
+		if (match->prints()) {
+			for (auto const& arg : command)
+				std::cout << arg << (&arg == &command.back() ? "" : " ");
+			std::cout << std::endl;
+			usage::record(usage_key(*selected));
+			cleanup();
+			exit(0);
+		}
 
-		close(STDOUT_FILENO);
-		dup2(pipe[1], STDOUT_FILENO);
-		std::cout << command << std::endl;
-		close(pipe[1]);
-		close(STDOUT_FILENO);
+		std::vector<char*> argv;
+		for (auto const& arg : command) argv.push_back(const_cast<char*>(arg.c_str()));
+		argv.push_back(nullptr);
+
+		// Command runs detached in its own session, so it outlives the menu and
+		// the terminal or window manager that started it
+		posix_spawnattr_t attr;
+		posix_spawnattr_init(&attr);
+#ifdef POSIX_SPAWN_SETSID
+		posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID);
+#endif
+		posix_spawn_file_actions_t actions;
+		posix_spawn_file_actions_init(&actions);
+		posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+
+		pid_t pid;
+		int const status = posix_spawnp(&pid, argv.front(), &actions, &attr, argv.data(), environ);
+#ifdef STATS
+		auto const spawned = chrono::steady_clock::now();
+#endif
+		posix_spawn_file_actions_destroy(&actions);
+		posix_spawnattr_destroy(&attr);
+
+		if (status == 0) {
+#ifdef STATS
+			std::cerr << "Enter to exec took " << chrono::duration_cast<chrono::microseconds>(spawned - enter).count() << "us, "
+				<< "startup to exec " << chrono::duration_cast<chrono::milliseconds>(spawned - started).count() << "ms" << std::endl;
+#endif
+			usage::record(usage_key(*selected));
+		} else {
+			std::cerr << "nlp-menu: cannot run " << command.front() << ": " << std::strerror(status) << std::endl;
+		}
 
 		cleanup();
-		execl("/bin/sh", "/bin/sh", (char*)nullptr);
-		exit(1);
+		exit(status == 0 ? 0 : 1);
 	}
 }
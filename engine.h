@@ -1,25 +1,46 @@
 #pragma once
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
 struct item {
-	char *text;
-	struct item *left, *right;
-	int out;
+	char const *text;  /* display text, valid until the next on_input_callback */
+	void const *match; /* suggestion the item was made from */
+	size_t len;        /* length of a line from stdin, which need not end in NUL */
 };
 
-extern struct item *items;
-extern struct item *prev, *curr, *next, *sel;
-extern struct item *matches, *matchend;
 extern unsigned lines;
 
 void cleanup(void);
+/* Unmaps the menu and releases the keyboard, before a command is run */
+void hide(void);
 
 void on_input_callback(char const*);
-void choose();
+
+/* Random access view of the results of the last on_input_callback */
+size_t result_count(void);
+struct item const* result(size_t i);
+
+void choose(struct item const* selected);
+
+/* Lines read from stdin, candidates of the (stdin) rule, as text and len.
+ * Their text has to stay valid for the lifetime of the engine. */
+void add_stdin(struct item const* items, size_t n);
+
+/* Appends the lines added since the last on_input_callback that match it
+ * to its results, earlier results keep their positions. Returns the new
+ * result_count */
+size_t extend_results(void);
+
+/* Loads frecency of past choices, choose() appends to the same file */
+void load_usage(char const *path);
+
+/* Cache of the (path-executables) scan, kept across runs */
+void set_path_cache(char const *path);
 
 #ifdef __cplusplus
 }
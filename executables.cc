@@ -0,0 +1,125 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern "C"
+{
+#include <stddef.h>
+#include "util.h"
+}
+
+// Executables of the directories in $PATH, what dmenu_path lists. The names
+// found in every directory are cached together with its mtime, which
+// changes whenever an entry is added, removed or renamed, so only changed
+// directories are read again.
+//
+// Cache file: Magic, then per directory its path length (u32), path, mtime
+// seconds and nanoseconds (i64 each), byte length (u32) of its names and the
+// names themselves, each terminated by NUL.
+namespace executables
+{
+	constexpr std::uint32_t Magic = 0x3178656e; // "nex1"
+
+	struct Dir
+	{
+		std::string path;
+		timespec mtime{};
+		std::vector<std::string> names;
+	};
+
+	std::vector<std::string> list(std::string const& dir)
+	{
+		std::vector<std::string> names;
+		auto d = opendir(dir.c_str());
+		if (!d) return names;
+
+		while (auto entry = readdir(d))
+			if (isexecutable(dirfd(d), entry->d_name))
+				names.emplace_back(entry->d_name);
+		closedir(d);
+
+		std::sort(names.begin(), names.end());
+		return names;
+	}
+
+	template<typename T>
+	bool take(std::string_view &sv, T &value)
+	{
+		if (sv.size() < sizeof(T)) return false;
+		std::memcpy(&value, sv.data(), sizeof(T));
+		sv.remove_prefix(sizeof(T));
+		return true;
+	}
+
+	// Directories by path, a file that does not parse gives what was read
+	// before the damage
+	std::unordered_map<std::string, Dir> load(std::string const& cache)
+	{
+		std::unordered_map<std::string, Dir> dirs;
+		std::ifstream stream(cache, std::ios::binary);
+		std::string const file{std::istreambuf_iterator<char>(stream), {}};
+		std::string_view sv = file;
+
+		std::uint32_t magic;
+		if (!take(sv, magic) || magic != Magic) return dirs;
+
+		for (;;) {
+			Dir dir;
+			std::uint32_t path_size, names_size;
+			std::int64_t sec, nsec;
+			if (!take(sv, path_size) || sv.size() < path_size) break;
+			dir.path = sv.substr(0, path_size);
+			sv.remove_prefix(path_size);
+			if (!take(sv, sec) || !take(sv, nsec) || !take(sv, names_size) || sv.size() < names_size) break;
+			dir.mtime = { time_t(sec), long(nsec) };
+
+			for (auto names = sv.substr(0, names_size); !names.empty(); ) {
+				auto const end = names.find('\0');
+				if (end == std::string_view::npos) break;
+				dir.names.emplace_back(names.substr(0, end));
+				names.remove_prefix(end + 1);
+			}
+			sv.remove_prefix(names_size);
+
+			auto key = dir.path;
+			dirs.insert_or_assign(std::move(key), std::move(dir));
+		}
+		return dirs;
+	}
+
+	void save(std::string const& cache, std::vector<Dir> const& dirs)
+	{
+		std::string out;
+		auto const put = [&](auto value) { out.append(reinterpret_cast<char const*>(&value), sizeof(value)); };
+
+		put(Magic);
+		for (auto const& dir : dirs) {
+			put(std::uint32_t(dir.path.size()));
+			out += dir.path;
+			put(std::int64_t(dir.mtime.tv_sec));
+			put(std::int64_t(dir.mtime.tv_nsec));
+			std::uint32_t names_size = 0;
+			for (auto const& name : dir.names) names_size += name.size() + 1;
+			put(names_size);
+			for (auto const& name : dir.names) out.append(name.c_str(), name.size() + 1);
+		}
+
+		auto const tmp = cache + ".tmp";
+		int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) return;
+		bool const written = write(fd, out.data(), out.size()) == ssize_t(out.size());
+		if (close(fd) != 0 || !written || rename(tmp.c_str(), cache.c_str()) != 0)
+			unlink(tmp.c_str());
+	}
+}
@@ -0,0 +1,134 @@
+#include <algorithm>
+#include <cstdint>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Keywords of one node in a trie over codepoints, searched with a bounded
+// Levenshtein automaton. Its state after a prefix of a keyword is the row of
+// edit distances between that prefix and every prefix of the typed word, so
+// rows are computed while walking down the trie and a subtree is left as soon
+// as every entry of the row is over the bound. The work follows the part of
+// the trie within reach of the word, not the number of keywords.
+//
+// Swapping two neighbouring characters counts as one edit, it is the most
+// common typo and would cost two otherwise.
+struct Keyword_Trie
+{
+	struct Node
+	{
+		std::vector<std::pair<char32_t, std::uint32_t>> children;
+		std::vector<std::uint32_t> ids;
+	};
+
+	struct Hit
+	{
+		std::uint32_t id;
+		unsigned distance;
+	};
+
+	std::vector<Node> nodes{1};
+
+	// Bytes that are not valid UTF-8 stand for themselves
+	static std::vector<char32_t> codepoints(std::string_view sv)
+	{
+		std::vector<char32_t> result;
+		while (!sv.empty()) {
+			char32_t c;
+			auto len = utf8::decode(sv, c);
+			if (len == 0) c = static_cast<unsigned char>(sv.front()), len = 1;
+			result.push_back(c);
+			sv.remove_prefix(len);
+		}
+		return result;
+	}
+
+	// Edits allowed for a typed word, short words would otherwise be one
+	// typo away from most keywords
+	static constexpr unsigned budget(std::string_view word)
+	{
+		auto const length = std::count_if(word.begin(), word.end(), [](char c) { return (c & 0xc0) != 0x80; });
+		return length < 4 ? 0 : length < 8 ? 1 : 2;
+	}
+
+	void add(std::uint32_t id, std::string_view key)
+	{
+		std::uint32_t node = 0;
+		for (auto c : codepoints(key)) {
+			auto &children = nodes[node].children;
+			auto it = std::find_if(children.begin(), children.end(), [c](auto const& child) { return child.first == c; });
+			if (it != children.end()) {
+				node = it->second;
+				continue;
+			}
+			children.emplace_back(c, nodes.size());
+			node = nodes.size();
+			nodes.emplace_back();
+		}
+		nodes[node].ids.push_back(id);
+	}
+
+	// Keywords within max_distance edits of word, or with a prefix within it
+	// when prefix is set. Every id is reported once with its smallest
+	// distance, closest first.
+	std::vector<Hit> search(std::string_view word, unsigned max_distance, bool prefix) const
+	{
+		Search search{ *this, codepoints(word), max_distance, prefix, {} };
+		std::vector<unsigned> row(search.word.size() + 1);
+		for (auto i = 0u; i < row.size(); ++i) row[i] = i;
+		search.walk(0, 0, row, {}, prefix && row.back() <= max_distance ? row.back() : Over);
+
+		auto &hits = search.hits;
+		std::sort(hits.begin(), hits.end(), [](Hit a, Hit b) { return a.id != b.id ? a.id < b.id : a.distance < b.distance; });
+		hits.erase(std::unique(hits.begin(), hits.end(), [](Hit a, Hit b) { return a.id == b.id; }), hits.end());
+		std::stable_sort(hits.begin(), hits.end(), [](Hit a, Hit b) { return a.distance < b.distance; });
+		return std::move(hits);
+	}
+
+private:
+	static constexpr unsigned Over = -1;
+
+	struct Search
+	{
+		Keyword_Trie const& trie;
+		std::vector<char32_t> word;
+		unsigned max_distance;
+		bool prefix;
+		std::vector<Hit> hits;
+
+		// Every keyword below node is at reached edits, a prefix already matched
+		void collect(std::uint32_t node, unsigned reached)
+		{
+			for (auto id : trie.nodes[node].ids) hits.push_back({ id, reached });
+			for (auto [_, child] : trie.nodes[node].children) collect(child, reached);
+		}
+
+		// row holds the distances for the path to node ending with c, before
+		// is the row one character up, for transpositions
+		void walk(std::uint32_t node, char32_t c, std::vector<unsigned> const& row, std::vector<unsigned> const& before, unsigned reached)
+		{
+			auto const& n = trie.nodes[node];
+			auto const distance = std::min(row.back(), reached);
+			if (distance <= max_distance)
+				for (auto id : n.ids) hits.push_back({ id, prefix ? distance : row.back() });
+
+			if (*std::min_element(row.begin(), row.end()) > max_distance) {
+				if (reached <= max_distance)
+					for (auto [_, child] : n.children) collect(child, reached);
+				return;
+			}
+
+			std::vector<unsigned> next(row.size());
+			for (auto [label, child] : n.children) {
+				next[0] = row[0] + 1;
+				for (auto i = 1u; i < row.size(); ++i) {
+					next[i] = std::min({ row[i] + 1, next[i-1] + 1, row[i-1] + (word[i-1] != label) });
+					if (i > 1 && !before.empty() && word[i-1] == c && word[i-2] == label)
+						next[i] = std::min(next[i], before[i-2] + 1);
+				}
+				auto const now = prefix && next.back() <= max_distance ? std::min(reached, next.back()) : reached;
+				walk(child, label, next, row, now);
+			}
+		}
+	};
+};
@@ -1,15 +1,25 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
 #include <charconv>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <future>
 #include <iomanip>
 #include <iostream>
 #include <list>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
-#include <regex>
 #include <set>
+#include <span>
+#include <stack>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <variant>
 #include <vector>
 
@@ -20,10 +30,23 @@ namespace fs = std::filesystem;
 using namespace std::string_literals;
 using namespace std::string_view_literals;
 
+// Raised for rules that cannot be built or run. Actions are built on a pool
+// of threads, the error reaches the main thread which reports it with fail.
+struct Error : std::runtime_error
+{
+	using std::runtime_error::runtime_error;
+};
+
 [[noreturn]]
 void error(std::string_view message)
 {
-	std::cerr << "ERROR: " << message << std::endl;
+	throw Error(std::string(message));
+}
+
+[[noreturn]]
+void fail(std::exception const& e)
+{
+	std::cerr << "ERROR: " << e.what() << std::endl;
 	std::exit(1);
 }
 
@@ -41,6 +64,14 @@ std::string_view trim(std::string_view sv)
 	return sv;
 }
 
+#include "unicode.cc"
+#include "stem.cc"
+#include "dfa.cc"
+#include "trigram.cc"
+#include "levenshtein.cc"
+#include "executables.cc"
+#include "usage.cc"
+
 namespace lisp
 {
 	using uint = unsigned long long;
@@ -77,10 +108,15 @@ namespace lisp
 
 		if (s.empty()) return {};
 
+		// A backslash in a string takes the character after it as is
 		if (s.starts_with('"')) {
-			auto end = std::adjacent_find(s.cbegin()+1, s.cend(), [](char p, char c) { return p != '\\' && c == '"'; });
-			auto str = Value::string({ s.cbegin()+1, end+1 });
-			s.remove_prefix(std::distance(s.cbegin(), end+2));
+			auto str = Value::string();
+			s.remove_prefix(1);
+			for (; !s.empty() && s.front() != '"'; s.remove_prefix(1)) {
+				if (s.front() == '\\' && s.size() > 1) s.remove_prefix(1);
+				str.str += s.front();
+			}
+			if (!s.empty()) s.remove_prefix(1);
 			return str;
 		}
 
@@ -116,6 +152,32 @@ namespace lisp
 		return {};
 	}
 
+	// Appends v in source form, equal values print the same
+	void print(Value const& v, std::string &out)
+	{
+		switch (v.kind) {
+		case Value::Kind::Nil: out += "nil"; break;
+		case Value::Kind::Number: out += std::to_string(v.num); break;
+		case Value::Kind::String:
+			out += '"';
+			for (char c : v.str) {
+				if (c == '"' || c == '\\') out += '\\';
+				out += c;
+			}
+			out += '"';
+			break;
+		case Value::Kind::Symbol: out += v.str; break;
+		case Value::Kind::List:
+			out += '(';
+			for (auto const& el : v) {
+				print(el, out);
+				out += ' ';
+			}
+			out += ')';
+			break;
+		}
+	}
+
 	Value dump(Value const& v, uint indent = 0)
 	{
 		std::cout << std::string(indent, ' ');
@@ -148,276 +210,771 @@ fs::path resolve_home(fs::path path)
 	return resolved;
 }
 
-std::vector<fs::path> find_dirs(fs::path root)
+// Bump allocator for strings that have to keep their address until all of
+// them are released at once
+struct Arena
 {
-	std::map<fs::path, std::vector<fs::path>> cache;
-	if (auto m = cache.find(root); m != cache.end())
-		return m->second;
+	static constexpr std::size_t Block_Size = 64 * 1024;
 
-	std::vector<fs::path> paths;
+	std::vector<std::unique_ptr<char[]>> blocks;
+	std::size_t used = 0, capacity = 0;
 
-	for (auto entry : fs::directory_iterator(resolve_home(root)))
-		if (entry.is_directory())
-			paths.push_back(fs::absolute(entry.path()));
+	char const* store(std::string_view sv)
+	{
+		if (blocks.empty() || used + sv.size() + 1 > capacity) {
+			capacity = std::max(Block_Size, sv.size() + 1);
+			blocks.push_back(std::make_unique<char[]>(capacity));
+			used = 0;
+		}
+
+		auto p = blocks.back().get() + used;
+		std::copy(sv.begin(), sv.end(), p);
+		p[sv.size()] = '\0';
+		used += sv.size() + 1;
+		return p;
+	}
 
-	cache.insert({ root, paths });
-	return paths;
+	void clear()
+	{
+		blocks.clear();
+		used = capacity = 0;
+	}
+};
+
+// Scanned file as its directory and name. Directories are stored once in
+// the file table and names in its arena, the full path is only put together
+// when a command is run.
+struct File
+{
+	std::uint32_t dir;
+	std::string_view name;
+
+	bool operator==(File const& other) const = default;
+};
+
+struct File_Table
+{
+	std::deque<std::string> dirs;
+	std::deque<std::uint64_t> dir_hashes; // usage::hash of the dir and '/'
+	std::unordered_map<std::string_view, std::uint32_t> dir_ids;
+	Arena names;
+	mutable std::mutex mutex;
+
+	// Adds an absolute path, names are NUL terminated
+	File add(std::string_view path)
+	{
+		auto const slash = path.rfind('/');
+		auto const dir = path.substr(0, slash), name = path.substr(slash + 1);
+
+		std::lock_guard lock(mutex);
+		auto it = dir_ids.find(dir);
+		if (it == dir_ids.end()) {
+			auto const id = std::uint32_t(dirs.size());
+			it = dir_ids.emplace(dirs.emplace_back(dir), id).first;
+			dir_hashes.push_back(usage::hash("/", usage::hash(dir)));
+		}
+		return { it->second, names.store(name) };
+	}
+
+	// usage::hash of the path, without building it. Files are only added
+	// while the tree is built, so no lock is needed once it is done.
+	std::uint64_t hash(File file) const
+	{
+		return usage::hash(file.name, dir_hashes[file.dir]);
+	}
+
+	std::string path(File file) const
+	{
+		std::lock_guard lock(mutex);
+		auto path = dirs[file.dir];
+		path += '/';
+		path += file.name;
+		return path;
+	}
+};
+
+File_Table files;
+
+// Results of directory scans by their call, shared between actions built
+// concurrently. The first caller scans, the others wait for its result or
+// get the exception it failed with.
+std::mutex scans_mutex;
+std::map<std::string, std::shared_future<std::vector<File>>> scans;
+
+template<typename Scan>
+std::vector<File> scan_once(std::string key, Scan scan)
+{
+	std::promise<std::vector<File>> promise;
+	std::shared_future<std::vector<File>> result;
+	bool scanning;
+	{
+		std::lock_guard lock(scans_mutex);
+		auto [it, inserted] = scans.try_emplace(std::move(key));
+		if (inserted) it->second = promise.get_future().share();
+		result = it->second;
+		scanning = inserted;
+	}
+	if (scanning) {
+		try {
+			promise.set_value(scan());
+		} catch (...) {
+			promise.set_exception(std::current_exception());
+		}
+	}
+	return result.get();
 }
 
-std::vector<fs::path> find_all_executable(fs::path root)
+// Scans start from an absolute root, so every entry path is absolute as is
+std::vector<File> find_dirs(fs::path root)
 {
-	std::map<fs::path, std::vector<fs::path>> cache;
-	if (auto m = cache.find(root); m != cache.end())
-		return m->second;
+	return scan_once("find-dirs " + root.string(), [&] {
+		std::vector<File> found;
+
+		for (auto entry : fs::directory_iterator(fs::absolute(resolve_home(root))))
+			if (entry.is_directory())
+				found.push_back(files.add(entry.path().native()));
+
+		return found;
+	});
+}
 
-	std::vector<fs::path> paths;
+std::vector<File> find_all_executable(fs::path root)
+{
+	return scan_once("find-all-executable " + root.string(), [&] {
+		std::vector<File> found;
 
-	for (auto entry : fs::recursive_directory_iterator(resolve_home(root)))
-		if (entry.is_regular_file() && (entry.status().permissions() & fs::perms::owner_exec) != fs::perms::none)
-			paths.push_back(fs::absolute(entry.path()));
+		for (auto entry : fs::recursive_directory_iterator(fs::absolute(resolve_home(root))))
+			if (entry.is_regular_file() && (entry.status().permissions() & fs::perms::owner_exec) != fs::perms::none)
+				found.push_back(files.add(entry.path().native()));
 
-	cache.insert({ root, paths });
-	return paths;
+		return found;
+	});
 }
 
-std::vector<fs::path> find_with_extension(fs::path root, std::vector<std::string_view> extensions)
+std::vector<File> find_with_extension(fs::path root, std::vector<std::string_view> extensions)
 {
-	std::vector<fs::path> paths;
+	std::vector<File> found;
 
-	for (auto entry : fs::recursive_directory_iterator(resolve_home(root))) {
+	for (auto entry : fs::recursive_directory_iterator(fs::absolute(resolve_home(root)))) {
 		if (!entry.is_regular_file()) continue;
-		std::string_view ext = entry.path().extension().c_str();
-		if (ext.starts_with('.') && std::find(extensions.begin(), extensions.end(), ext.substr(1)) != extensions.cend())
-			paths.push_back(fs::absolute(entry.path()));
+		std::string_view const path = entry.path().native();
+		auto const dot = path.rfind('.');
+		if (dot == std::string_view::npos || dot < path.rfind('/') + 2) continue;
+		if (std::find(extensions.begin(), extensions.end(), path.substr(dot + 1)) != extensions.cend())
+			found.push_back(files.add(path));
+	}
+
+	return found;
+}
+
+std::vector<File> find_all_processes()
+{
+	std::set<std::string> paths;
+	std::error_code ec;
+
+	// Only /proc/<pid>/exe, processes may exit while they are listed
+	for (auto const& entry : fs::directory_iterator("/proc/", fs::directory_options::skip_permission_denied, ec)) {
+		auto const name = entry.path().filename().string();
+		if (name.empty() || !std::all_of(name.begin(), name.end(), [](char c) { return std::isdigit(c); }))
+			continue;
+		if (auto exe = fs::canonical(entry.path() / "exe", ec); !ec)
+			paths.insert(exe.native());
 	}
 
-	return paths;
+	std::vector<File> found;
+	for (auto const& path : paths) found.push_back(files.add(path));
+	return found;
 }
 
-std::vector<fs::path> find_all_processes()
+// Runs f(0) .. f(n-1) on up to hardware_concurrency threads, the calling
+// one included. The first exception stops the remaining calls and is
+// rethrown on the calling thread once all threads are done.
+template<typename F>
+void parallel_for(std::size_t n, F f)
 {
-	std::set<fs::path> paths;
+	std::atomic<std::size_t> claimed = 0;
+	std::mutex failed_mutex;
+	std::exception_ptr failed;
+	auto const work = [&] {
+		try {
+			for (std::size_t i; (i = claimed++) < n; )
+				f(i);
+		} catch (...) {
+			claimed = n;
+			std::lock_guard lock(failed_mutex);
+			if (!failed) failed = std::current_exception();
+		}
+	};
 
-	for (auto entry : fs::recursive_directory_iterator("/proc/", fs::directory_options::skip_permission_denied)) {
-		auto p = entry.path();
-		if (p.filename() == "exe") {
-			try {
-				paths.insert(fs::canonical(p));
-			} catch (std::exception const&) {}
+	auto const threads = std::min<std::size_t>(n, std::max(1u, std::thread::hardware_concurrency()));
+	std::vector<std::thread> pool;
+	for (auto i = 1u; i < threads; ++i) pool.emplace_back(work);
+	work();
+	for (auto &thread : pool) thread.join();
+	if (failed) std::rethrow_exception(failed);
+}
+
+// Cache of the names found in $PATH directories, none when empty
+std::string path_cache;
+
+// Commands found in $PATH as dmenu_path lists them, a name shadowed by an
+// earlier directory is left out. Only directories changed since the cache
+// was written are read, in parallel.
+std::vector<File> find_path_executables()
+{
+	return scan_once("path-executables", [] {
+		std::vector<executables::Dir> dirs;
+		auto const env = std::getenv("PATH");
+		for (std::string_view rest = env ? env : ""; !rest.empty(); ) {
+			auto const colon = std::min(rest.find(':'), rest.size());
+			auto dir = rest.substr(0, colon);
+			rest.remove_prefix(std::min(colon + 1, rest.size()));
+			while (dir.size() > 1 && dir.back() == '/') dir.remove_suffix(1);
+			if (dir.empty() || std::any_of(dirs.begin(), dirs.end(), [&](auto const& d) { return d.path == dir; }))
+				continue;
+			dirs.push_back({ std::string(dir), {}, {} });
 		}
+
+		std::unordered_map<std::string, executables::Dir> cached;
+		if (!path_cache.empty()) cached = executables::load(path_cache);
+		std::vector<std::size_t> stale;
+		for (auto i = 0u; i < dirs.size(); ++i) {
+			auto &dir = dirs[i];
+			struct stat st;
+			if (stat(dir.path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) continue;
+			dir.mtime = st.st_mtim;
+
+			auto it = cached.find(dir.path);
+			if (it != cached.end() && it->second.mtime.tv_sec == dir.mtime.tv_sec && it->second.mtime.tv_nsec == dir.mtime.tv_nsec)
+				dir.names = std::move(it->second.names);
+			else
+				stale.push_back(i);
+		}
+
+		parallel_for(stale.size(), [&](std::size_t i) { dirs[stale[i]].names = executables::list(dirs[stale[i]].path); });
+		if (!path_cache.empty() && (!stale.empty() || cached.size() != dirs.size()))
+			executables::save(path_cache, dirs);
+
+		std::map<std::string_view, std::string_view> first;
+		for (auto const& dir : dirs)
+			for (auto const& name : dir.names)
+				first.try_emplace(name, dir.path);
+
+		std::vector<File> found;
+		found.reserve(first.size());
+		for (auto [name, dir] : first)
+			found.push_back(files.add(std::string(dir == "/" ? "" : dir) + '/' + std::string(name)));
+		return found;
+	});
+}
+
+// Builtins whose results are only known by looking at the system
+bool is_scan(lisp::Value const& call)
+{
+	return call.is_call_to("find-dirs") || call.is_call_to("processes") || call.is_call_to("path-executables")
+		|| call.is_call_to("find-all-executable") || call.is_call_to("find-all-with-extension");
+}
+
+std::vector<File> scan(lisp::Value const& call)
+{
+	auto arg = call.cbegin();
+
+	if (call.is_call_to("find-dirs"))
+		return find_dirs((++arg)->str);
+
+	if (call.is_call_to("processes"))
+		return find_all_processes();
+
+	if (call.is_call_to("path-executables"))
+		return find_path_executables();
+
+	if (call.is_call_to("find-all-executable"))
+		return find_all_executable((++arg)->str);
+
+	auto const& extensions_declaration = *++arg;
+	auto const& root = (++arg)->str;
+
+	std::vector<std::string_view> extensions;
+	for (auto const& ext : extensions_declaration) {
+		ensure(ext.kind == lisp::Value::Kind::String, "Extensions group must be all strings");
+		extensions.push_back(ext.str);
 	}
+	return find_with_extension(root, std::move(extensions));
+}
+
+// Rules compiled ahead of time keep scans as calls, they run at startup
+bool defer_scans = false;
+
+// Search keys of one candidate line, computed once when it is added
+struct Candidate
+{
+	std::string_view text;
+	std::string_view key, ascii_key;
+
+	std::string_view key_for(bool ascii_token) const
+	{
+		return ascii_token && !ascii_key.empty() ? ascii_key : key;
+	}
+};
+
+// Lines that are not known when the tree is built, like the ones streamed
+// from stdin. Keys of all of them share one arena.
+struct Candidate_List
+{
+	std::vector<Candidate> lines;
+	Arena keys;
+	Trigram_Index index;
+	std::string buffer;
+
+	void add(std::string_view text)
+	{
+		buffer.resize(utf8::lower_capacity(text.size()));
+		auto const key = std::string_view(buffer.data(), utf8::to_lower(text, buffer.data()));
+		auto& line = lines.emplace_back(Candidate{ text, keys.store(key), {} });
+
+		auto ascii = std::string(key.size(), '\0');
+		ascii.resize(utf8::strip_diacritics(key, ascii.data()));
+		if (ascii != key) line.ascii_key = keys.store(ascii);
+
+		index.add(lines.size() - 1, line.key);
+		if (!line.ascii_key.empty()) index.add(lines.size() - 1, line.ascii_key);
+	}
+};
+
+Candidate_List stdin_lines;
+std::atomic<bool> stdin_used = false;
+
+// Node standing for every line of a candidate list
+struct Candidates
+{
+	Candidate_List const* list;
+
+	bool operator==(Candidates const& other) const = default;
+};
+
+// Compiled regex rule. Nodes built from the same source share one automaton.
+struct Pattern
+{
+	std::string_view source;
+	std::shared_ptr<Dfa const> dfa;
 
-	return { paths.begin(), paths.end() };
+	bool operator==(Pattern const& other) const { return dfa == other.dfa; }
+};
+
+constexpr std::string_view Email_Pattern = "[a-zA-Z0-9._%+-]+@[a-zA-Z0-9.-]+\\.[a-zA-Z]+";
+constexpr std::string_view Url_Pattern = "(https?://|www\\.)[^ \t]+";
+
+Pattern compile_pattern(std::string_view source)
+{
+	static std::map<std::string, std::shared_ptr<Dfa const>, std::less<>> compiled;
+	static std::mutex mutex;
+	std::lock_guard lock(mutex);
+	auto it = compiled.find(source);
+	if (it == compiled.end())
+		it = compiled.emplace(source, std::make_shared<Dfa const>(regex::compile(source))).first;
+	return { it->first, it->second };
 }
 
-using Match_Variant = std::variant<std::monostate, std::string, std::regex, fs::path>;
+using Match_Variant = std::variant<std::monostate, std::string, Pattern, File, Candidates>;
+
+struct Match;
+
+// Nodes built for rule tails, see Match::tail. Actions are built on several
+// threads, each shares tails only among the actions it builds.
+thread_local std::unordered_map<std::string, std::shared_ptr<Match>> tails;
+
+// Node matched at one rule position while walking the tree, with the text
+// typed for it when the node is a slot
+struct Binding
+{
+	Match const* node;
+	std::string_view text;
+};
 
 struct Match : Match_Variant
 {
-	std::vector<std::unique_ptr<Match>> next{};
+	// Children are shared: every alternative of one-of and every path of a
+	// directory listing leads to the same node for the rest of the rule
+	std::vector<std::shared_ptr<Match>> next{};
 	lisp::Value const* command = nullptr;
 
+	// Scan this node stands for until it is expanded, see defer_scans
+	lisp::Value const* scan_call = nullptr;
+
+	// Trigram index of the filenames among children, when there are enough of
+	// them, and positions of the children it does not cover
+	static constexpr std::size_t Index_Threshold = 256;
+	std::shared_ptr<Trigram_Index const> trigrams;
+	std::vector<std::uint32_t> unindexed;
+
+	// Keywords among children for typo tolerant matching, by their position
+	std::shared_ptr<Keyword_Trie const> keywords;
+
+	// Search keys computed once when the node is built: lowercase text and
+	// the same text without diacritics (empty when there are none)
+	std::string key, ascii_key;
+
+	// Lemma of a keyword, inflected forms of one word compare equal by it
+	std::string lemma;
+
+	// Other spellings of a keyword merged into this node by their lemma, as
+	// key and ascii_key pairs, each can still be typed as a prefix
+	std::vector<std::pair<std::string, std::string>> aliases;
+
 	auto const& as_variant() const { return *static_cast<Match_Variant const*>(this); }
 
-	Match* put() { return next.emplace_back(std::make_unique<Match>()).get(); }
+	void set(std::string s)
+	{
+		index(s);
+		lemma = stem::stem(ascii_key.empty() ? key : ascii_key);
+		emplace<std::string>(std::move(s));
+	}
+
+	void set(File file)
+	{
+		index(file.name);
+		emplace<File>(file);
+	}
+
+	void index(std::string_view text)
+	{
+		key = utf8::to_lower(text);
+		ascii_key = utf8::strip_diacritics(key);
+		if (ascii_key == key) ascii_key.clear();
+	}
+
+	// Key to compare with query token, tokens typed without diacritics
+	// match the stripped form
+	std::string_view key_for(bool ascii_token) const
+	{
+		return ascii_token && !ascii_key.empty() ? ascii_key : key;
+	}
+
+	// Keys of every spelling of a keyword, as key_for picks them
+	template<typename F>
+	void for_each_key(bool ascii_token, F f) const
+	{
+		f(key_for(ascii_token));
+		for (auto const& [alias, ascii_alias] : aliases)
+			f(ascii_token && !ascii_alias.empty() ? std::string_view(ascii_alias) : std::string_view(alias));
+	}
+
+	// Keeps the spellings of other, merged into this node, searchable
+	void add_aliases(Match const& other)
+	{
+		auto const add = [&](std::string const& key, std::string const& ascii_key) {
+			if (key != this->key && std::none_of(aliases.begin(), aliases.end(), [&](auto const& a) { return a.first == key; }))
+				aliases.emplace_back(key, ascii_key);
+		};
+		add(other.key, other.ascii_key);
+		for (auto const& [key, ascii_key] : other.aliases) add(key, ascii_key);
+	}
+
+	Match* put() { return next.emplace_back(std::make_shared<Match>()).get(); }
+
+	// Links this node to what follows it: the rest of the rule or the command
+	void attach(std::shared_ptr<Match> const& rest, lisp::Value const* command)
+	{
+		if (rest) next.push_back(rest);
+		else this->command = command;
+	}
+
+	// Node for the rule elements [rule, rule_end) followed by rest. Tails are
+	// hash-consed by their source, so equal ones are built once.
+	static std::shared_ptr<Match> tail(lisp::Value::const_iterator rule, lisp::Value::const_iterator rule_end,
+		lisp::Value const* command, std::shared_ptr<Match> const& rest)
+	{
+		if (rule == rule_end) return rest;
+
+		std::string key;
+		for (auto it = rule; it != rule_end; ++it) lisp::print(*it, key);
+		key += '\0';
+		if (rest) key += std::to_string(reinterpret_cast<std::uintptr_t>(rest.get()));
+		else if (command) lisp::print(*command, key);
+
+		auto &node = tails[key];
+		if (!node) {
+			node = std::make_shared<Match>();
+			node->eval(rule, rule_end, command, rest);
+		}
+		return node;
+	}
+
+	// Identity under which siblings are merged, equal for nodes that compare equal
+	std::string identity() const
+	{
+		if (std::get_if<std::string>(this)) return "s" + lemma;
+		if (auto x = std::get_if<File>(this)) return "p" + std::to_string(x->dir) + "/" + std::string(x->name);
+		if (auto x = std::get_if<Pattern>(this)) return "r" + std::to_string(reinterpret_cast<std::uintptr_t>(x->dfa.get()));
+		if (auto x = std::get_if<Candidates>(this)) return "c" + std::to_string(reinterpret_cast<std::uintptr_t>(x->list));
+		return "m" + std::to_string(reinterpret_cast<std::uintptr_t>(this));
+	}
 
 	auto operator==(Match const& other) const
 	{
 		if (auto p = std::get_if<std::monostate>(this), q = std::get_if<std::monostate>(&other); p && q) return true;
-		if (auto p = std::get_if<std::string>(this), q = std::get_if<std::string>(&other); p && q) return *p == *q;
-		if (auto p = std::get_if<fs::path>(this), q = std::get_if<fs::path>(&other); p && q) return *p == *q;
+		if (auto p = std::get_if<std::string>(this), q = std::get_if<std::string>(&other); p && q) return lemma == other.lemma;
+		if (auto p = std::get_if<File>(this), q = std::get_if<File>(&other); p && q) return *p == *q;
+		if (auto p = std::get_if<Pattern>(this), q = std::get_if<Pattern>(&other); p && q) return *p == *q;
+		if (auto p = std::get_if<Candidates>(this), q = std::get_if<Candidates>(&other); p && q) return *p == *q;
 		return false;
 	}
 
-	std::string eval() const
+	// Value bound at the rule position, for keywords the keyword itself
+	static std::string value(Binding const& binding)
+	{
+		if (std::get_if<Pattern>(binding.node) || std::get_if<Candidates>(binding.node)) return std::string(binding.text);
+		if (auto x = std::get_if<std::string>(binding.node)) return *x;
+		if (auto x = std::get_if<File>(binding.node)) return files.path(*x);
+		error("this type is not supported yet");
+	}
+
+	// usage::hash of value(binding), without copying it
+	static std::uint64_t value_hash(Binding const& binding)
+	{
+		if (std::get_if<Pattern>(binding.node) || std::get_if<Candidates>(binding.node)) return usage::hash(binding.text);
+		if (auto x = std::get_if<std::string>(binding.node)) return usage::hash(*x);
+		if (auto x = std::get_if<File>(binding.node)) return files.hash(*x);
+		error("this type is not supported yet");
+	}
+
+	// Command starts with the symbol name, like (print last)
+	bool headed_by(std::string_view name) const
+	{
+		return command && !command->empty() && command->front().kind == lisp::Value::Kind::Symbol && command->front().str == name;
+	}
+
+	// Command prints its arguments to stdout instead of running them,
+	// like dmenu does with the chosen line
+	bool prints() const { return headed_by("print"); }
+
+	// Command is a /bin/sh script, like (sh "cd" last "&& make"):
+	// literals are pasted as they are and bound values quoted
+	bool runs_shell() const { return headed_by("sh"); }
+
+	// Arguments are literals, bound rule positions like 2 and last, and
+	// (concat ...) of those, which joins them into one argument
+
+	// Expands command of this node into argv, every literal is one argument.
+	// Numbers refer to values bound at rule positions counted from 1 along
+	// path, last to this node.
+	std::vector<std::string> eval(std::vector<Binding> path = {}) const
 	{
 		assert(command);
 
-		auto result = std::string{};
+		if (path.empty() || path.back().node != this)
+			path.push_back({ this, {} });
+
+		auto argv = std::vector<std::string>{};
+		auto script = std::string{};
+		bool const shell = runs_shell();
+		auto const add = [&](std::string arg, bool literal) {
+			if (!shell) argv.push_back(std::move(arg));
+			else script += (script.empty() ? "" : " ") + (literal ? arg : os_exec::shell_quote(arg));
+		};
+
+		auto const bound = [&](lisp::Value const& v) -> std::string {
+			if (v.kind == lisp::Value::Kind::Number) {
+				ensure(v.num >= 1 && v.num <= path.size(), "Command refers to rule position that is not bound");
+				return value(path[v.num - 1]);
+			}
+			if (v.kind == lisp::Value::Kind::Symbol && v.str == "last") return value(path.back());
+			if (v.kind == lisp::Value::Kind::String) return v.str;
+			error("concat takes strings, rule positions and last");
+		};
 
 		for (auto const& v : *command) {
 			switch (v.kind) {
 			case lisp::Value::Kind::Nil: continue;
-			case lisp::Value::Kind::Number: continue;
-			case lisp::Value::Kind::String: result += " " + os_exec::shell_quote(v.str); break;
+			case lisp::Value::Kind::Number:
+				add(bound(v), false);
+				break;
+			case lisp::Value::Kind::String:
+				add(v.str, true);
+				break;
 			case lisp::Value::Kind::Symbol:
 				if (v.str == "last") {
-					if (auto x = std::get_if<std::string>(this)) { result += " " + os_exec::shell_quote(*x); continue; }
-					if (auto x = std::get_if<fs::path>(this)) { result += " " + os_exec::shell_quote(x->string()); continue; }
-					error("this type is not supported yet");
+					add(bound(v), false);
+					continue;
 				}
+				if ((v.str == "print" || v.str == "sh") && &v == &command->front()) continue;
 				error("unsupported symbol name");
 			case lisp::Value::Kind::List:
-				error("Execution of list is not supported yet");
+				if (!v.is_call_to("concat")) error("Execution of list is not supported yet");
+				{
+					std::string joined;
+					for (auto it = std::next(v.cbegin()); it != v.cend(); ++it) joined += bound(*it);
+					add(std::move(joined), false);
+				}
+				break;
 			}
 		}
 
-		return result;
+		if (!shell) return argv;
+		return { "/bin/sh", "-c", std::move(script) };
 	}
 
-	// Evaluates rule, to this node and passes unevaluated to children
-	Match* eval(lisp::Value::const_iterator rule, lisp::Value::const_iterator rule_end, lisp::Value const* command)
+	// Evaluates rule, to this node and passes unevaluated to children. What
+	// follows rule_end is rest, or the command when there is nothing more.
+	void eval(lisp::Value::const_iterator rule, lisp::Value::const_iterator rule_end, lisp::Value const* command, std::shared_ptr<Match> const& rest)
 	{
 		using namespace lisp;
+
+		auto const following = tail(std::next(rule), rule_end, command, rest);
+
+		auto const fan_out = [&](std::vector<File> found) {
+			for (auto file : found) {
+				auto next = put();
+				next->set(file);
+				next->attach(following, command);
+			}
+		};
+
 		switch (rule->kind) {
 		case Value::Kind::Nil:    error("Nil cannot be rule");
 		case Value::Kind::Number: error("Number cannot be rule");
 		case Value::Kind::Symbol:
 			{
-				if (rule->str == "match-email") error("Matching email is not implemented yet");
-				if (rule->str == "match-url") error("matching url is not implemented yet");
+				if (rule->str == "match-email") { emplace<Pattern>(compile_pattern(Email_Pattern)); break; }
+				if (rule->str == "match-url")   { emplace<Pattern>(compile_pattern(Url_Pattern)); break; }
 				error("Uncrecognized symbol");
 			}
 			break;
 		case Value::Kind::String:
-			emplace<std::string>(rule->str);
+			set(rule->str);
 			break;
 		case Value::Kind::List:
 			if (rule->is_call_to("one-of")) {
-				auto cmd = std::next(rule) == rule_end ? command : nullptr;
-				for (auto posibility = std::next(rule->cbegin()); posibility != rule->cend(); ++posibility) {
-					auto next = put()->eval(posibility, std::next(posibility), cmd);
-					if (std::next(rule) != rule_end) next->put()->eval(std::next(rule), rule_end, command);
-				}
-				return this;
+				for (auto posibility = std::next(rule->cbegin()); posibility != rule->cend(); ++posibility)
+					put()->eval(posibility, std::next(posibility), command, following);
+				return;
 			}
 
-			if (rule->is_call_to("find-dirs")) {
-				auto arg = rule->cbegin();
-				auto const& root = (++arg)->str;
-
-				auto paths = find_dirs(root);
-
-				for (auto path : paths) {
-					auto next = put();
-					next->emplace<fs::path>(std::move(path));
-					if (std::next(rule) != rule_end)
-						next->put()->eval(std::next(rule), rule_end, command);
-
-					if (std::next(rule) == rule_end)
-						next->command = command;
+			if (is_scan(*rule)) {
+				if (defer_scans) {
+					scan_call = &*rule;
+					break;
 				}
-
-				return this;
+				fan_out(scan(*rule));
+				return;
 			}
 
-			if (rule->is_call_to("processes")) {
-				auto paths = find_all_processes();
-
-				for (auto path : paths) {
-					auto next = put();
-					next->emplace<fs::path>(std::move(path));
-					if (std::next(rule) != rule_end)
-						next->put()->eval(std::next(rule), rule_end, command);
-
-					if (std::next(rule) == rule_end)
-						next->command = command;
-				}
+			if (rule->is_call_to("stdin")) {
+				emplace<Candidates>(Candidates{ &stdin_lines });
+				stdin_used = true;
+				break;
+			}
 
-				return this;
+			if (rule->is_call_to("regex")) {
+				ensure(rule->size() == 2 && std::next(rule->cbegin())->kind == lisp::Value::Kind::String, "regex requires pattern string");
+				emplace<Pattern>(compile_pattern(std::next(rule->cbegin())->str));
+				break;
 			}
 
-			if (rule->is_call_to("find-all-executable")) {
-				auto arg = rule->cbegin();
-				auto const& root = (++arg)->str;
+			error("Unrecognized function call");
+			break;
+		}
 
-				auto paths = find_all_executable(root);
+		attach(following, command);
+	}
 
-				for (auto path : paths) {
-					auto next = put();
-					next->emplace<fs::path>(std::move(path));
-					if (std::next(rule) != rule_end)
-						next->put()->eval(std::next(rule), rule_end, command);
+	static bool same_command(lisp::Value const& a, lisp::Value const& b)
+	{
+		if (&a == &b) return true;
+		std::string x, y;
+		lisp::print(a, x);
+		lisp::print(b, y);
+		return x == y;
+	}
 
-					if (std::next(rule) == rule_end)
-						next->command = command;
-				}
+	void optimize()
+	{
+		std::unordered_set<Match const*> visited;
+		optimize(visited);
+	}
 
-				return this;
+	// Lifts children of empty nodes and merges equal siblings, then goes
+	// down. Shared nodes are optimized once, and a shared node is copied
+	// before siblings are merged into it, so its other parents keep seeing
+	// it unchanged.
+	void optimize(std::unordered_set<Match const*> &visited)
+	{
+		if (!visited.insert(this).second) return;
+
+		for (auto i = 0u; i < next.size(); ) {
+			if (std::get_if<std::monostate>(next[i].get()) && !next[i]->command && !next[i]->scan_call) {
+				auto empty = std::move(next[i]);
+				next.erase(next.begin() + i);
+				next.insert(next.end(), empty->next.begin(), empty->next.end());
+			} else {
+				++i;
 			}
+		}
 
-			if (rule->is_call_to("find-all-with-extension")) {
-				auto arg = rule->cbegin();
-				auto const& extensions_declaration = *++arg;
-				auto const& root = (++arg)->str;
-
-				std::vector<std::string_view> extensions;
-				for (auto const& ext : extensions_declaration) {
-					ensure(ext.kind == lisp::Value::Kind::String, "Extensions group must be all strings");
-					extensions.push_back(ext.str);
-				}
-				auto paths = find_with_extension(root, std::move(extensions));
-
-				for (auto path : paths) {
-					auto next = put();
-					next->emplace<fs::path>(std::move(path));
-					if (std::next(rule) != rule_end)
-						next->put()->eval(std::next(rule), rule_end, command);
+		std::unordered_map<std::string, std::size_t> first;
+		std::vector<std::shared_ptr<Match>> merged;
+		merged.reserve(next.size());
+		for (auto &child : next) {
+			auto [it, inserted] = first.try_emplace(child->identity(), merged.size());
+			if (inserted) {
+				merged.push_back(std::move(child));
+				continue;
+			}
 
-					if (std::next(rule) == rule_end)
-						next->command = command;
-				}
+			auto &into = merged[it->second];
+			if (into == child) continue;
 
-				return this;
+			// Both run something different, one node could only keep one
+			if (into->command && child->command && !same_command(*into->command, *child->command)) {
+				merged.push_back(std::move(child));
+				continue;
 			}
 
-			error("Unrecognized function call");
-			break;
+			if (into.use_count() > 1) into = std::make_shared<Match>(*into);
+			into->next.insert(into->next.end(), child->next.begin(), child->next.end());
+			if (!into->command) into->command = child->command;
+			if (std::get_if<std::string>(into.get())) into->add_aliases(*child);
 		}
+		next = std::move(merged);
+		build_index();
 
-		if (++rule != rule_end) return put()->eval(rule, rule_end, command);
-		this->command = command;
-		return this;
+		for (auto &child : next)
+			child->optimize(visited);
 	}
 
-	bool optimize()
+	void build_index()
 	{
-		bool try_again = true;
-		bool done_something = false;
-
-		while (try_again) {
-			try_again = false;
-
-			for (auto &child : next)
-				try_again |= child->optimize();
-
-			// For all possible unordered pairs try unification
-			for (unsigned i = 0; i < next.size(); ++i) {
-				for (unsigned j = i+1; j < next.size(); ++j) {
-					if (*next[i] == *next[j]) {
-						std::move(next[j]->next.begin(), next[j]->next.end(), std::back_inserter(next[i]->next));
-						next.erase(next.begin() + j);
-						done_something = try_again = true;
-					}
+		trigrams.reset();
+		unindexed.clear();
+		keywords.reset();
+
+		if (std::any_of(next.begin(), next.end(), [](auto const& c) { return std::get_if<std::string>(c.get()); })) {
+			auto trie = std::make_shared<Keyword_Trie>();
+			for (auto i = 0u; i < next.size(); ++i) {
+				if (!std::get_if<std::string>(next[i].get())) continue;
+				trie->add(i, next[i]->key);
+				if (!next[i]->ascii_key.empty()) trie->add(i, next[i]->ascii_key);
+				for (auto const& [alias, ascii_alias] : next[i]->aliases) {
+					trie->add(i, alias);
+					if (!ascii_alias.empty()) trie->add(i, ascii_alias);
 				}
-				try_again |= next[i]->optimize();
 			}
+			keywords = std::move(trie);
+		}
 
-			if (next.size() == 1 && std::get_if<std::monostate>(next.front().get())) {
-				auto succ = std::move(next.front());
-				next.clear();
-				next.reserve(succ->next.size());
-				std::move(succ->next.begin(), succ->next.end(), std::back_inserter(next));
-				done_something = try_again = true;
-			}
+		auto const paths = std::count_if(next.begin(), next.end(), [](auto const& c) { return std::get_if<File>(c.get()); });
+		if (std::size_t(paths) < Index_Threshold) return;
 
-			if (std::get_if<std::monostate>(this)) {
-				for (bool revisit = true; revisit;) {
-					revisit = false;
-					for (auto i = 0u; i < next.size(); ++i) {
-						if (std::get_if<std::monostate>(next[i].get())) {
-							std::move(next[i]->next.begin(), next[i]->next.end(), std::back_inserter(next));
-							next.erase(next.begin() + i);
-							try_again = true;
-							revisit = true;
-							break;
-						}
-					}
-				}
+		auto built = std::make_shared<Trigram_Index>();
+		for (auto i = 0u; i < next.size(); ++i) {
+			if (!std::get_if<File>(next[i].get())) {
+				unindexed.push_back(i);
+				continue;
 			}
+			built->add(i, next[i]->key);
+			if (!next[i]->ascii_key.empty()) built->add(i, next[i]->ascii_key);
 		}
-
-		return done_something;
+		trigrams = std::move(built);
 	}
 };
 
@@ -429,18 +986,25 @@ void dump(Match const& match)
 	std::cout << "digraph Suggestion_Tree {\n";
 
 	std::stack<Match const*> stack;
+	std::unordered_set<Match const*> printed;
 	stack.push(&match);
 
 	while (!stack.empty()) {
 		auto top = stack.top();
 		stack.pop();
+		if (!printed.insert(top).second) continue;
 
 		std::cout << "Node_" << std::hex << top;
 		std::visit(overload{
-			[](std::monostate)       { std::cout << " [label=\"<>\"];\n"; },
+			[&](std::monostate) {
+				std::string label = "<>";
+				if (top->scan_call) lisp::print(*top->scan_call, label = {});
+				std::cout << " [label=" << std::quoted(label) << "];\n";
+			},
 			[](std::string const& s) { std::cout << " [label=" << std::quoted(s) << "];\n"; },
-			[](fs::path const& f)    { std::cout << " [label=" << f.filename() << "];\n"; },
-			[](std::regex const&)    { std::cout << " [label=regex];\n"; },
+			[](File const& f)        { std::cout << " [label=" << std::quoted(f.name) << "];\n"; },
+			[](Pattern const& p)     { std::cout << " [label=" << std::quoted(p.source) << "];\n"; },
+			[](Candidates const&)    { std::cout << " [label=\"<stdin>\"];\n"; },
 		}, top->as_variant());
 
 		if (top->command) {
@@ -457,34 +1021,321 @@ void dump(Match const& match)
 	std::cout << "}" << std::endl;
 }
 
+// Tables emitted by `lisp -c` for rules compiled into the binary. Keywords
+// come with their search keys, patterns with their automata and commands
+// as argv templates, so only the scans are left to run at startup.
+namespace compiled
+{
+	struct Pattern
+	{
+		std::string_view source;
+		Dfa::State start;
+		std::uint32_t classes;
+		std::array<std::uint8_t, 256> byte_class;
+		std::span<Dfa::State const> table;
+		std::span<bool const> accepting;
+	};
+
+	struct Arg
+	{
+		lisp::Value::Kind kind;
+		std::string_view str;
+		lisp::uint num;
+	};
+
+	struct Node
+	{
+		enum class Kind : std::uint8_t { Empty, Keyword, Pattern, Stdin, Scan } kind;
+
+		// Keyword with its keys, or source of the scan call. Aliases are the
+		// key and ascii_key of every other spelling, each followed by \037.
+		std::string_view text, key, ascii_key, lemma, aliases;
+		std::uint32_t pattern;
+		std::uint32_t children_begin, children_end;
+
+		// Range of args of the command, empty when there is none
+		std::uint32_t command_begin, command_end;
+	};
+
+	struct Rules
+	{
+		std::span<Node const> nodes;
+		std::span<std::uint32_t const> children;
+		std::span<Arg const> args;
+		std::span<Pattern const> patterns;
+	};
+}
+
 struct Suggestion_Tree : Match
 {
+	// Commands and scan calls of compiled rules, nodes point into it
+	lisp::Value compiled_values = lisp::Value::list();
+
 	void eval(lisp::Value const&);
+	void load(compiled::Rules const&);
 };
 
+// Actions are independent, each one is built on a pool of threads and they
+// are added in the order of the rules once all are done. Building takes as
+// long as the slowest scan instead of all of them in turn.
 void Suggestion_Tree::eval(lisp::Value const& v)
 {
-	Suggestion_Tree tree;
-
 	ensure(v.is_call_to("do"), "Expected do call");
 
+	std::vector<lisp::Value const*> actions;
 	for (auto action = std::next(v.cbegin()); action != v.cend(); ++action) {
 		ensure(action->is_call_to("action"), "Expected action call");
 		ensure(action->size() == 3, "Action requires rule definition and command declaration");
+		auto const& command = action->back();
+		ensure(command.kind == lisp::Value::Kind::List, "Command has to be a list");
+		auto const runs = command.size() - (command.is_call_to("print") || command.is_call_to("sh"));
+		ensure(runs > 0, "Command is empty");
+		actions.push_back(&*action);
+	}
 
-		auto args = action->cbegin();
+	std::vector<std::shared_ptr<Match>> built(actions.size());
+	parallel_for(actions.size(), [&](std::size_t i) {
+		auto args = actions[i]->cbegin();
 		auto const &rule = *++args;
 		auto const command = &*++args;
-		put()->eval(rule.cbegin(), rule.cend(), command);
+		built[i] = tail(rule.cbegin(), rule.cend(), command, nullptr);
+	});
+	tails.clear();
+
+	next.insert(next.end(), built.begin(), built.end());
+}
+
+// Rebuilds the tree compiled by `lisp -c`, node 0 is the root. Scans run
+// concurrently, their paths become children of the scan node followed by
+// whatever followed it.
+void Suggestion_Tree::load(compiled::Rules const& rules)
+{
+	std::vector<std::shared_ptr<Dfa const>> dfas;
+	for (auto const& p : rules.patterns)
+		dfas.push_back(std::make_shared<Dfa const>(Dfa{ p.start, p.classes, p.byte_class,
+			{ p.table.begin(), p.table.end() }, { p.accepting.begin(), p.accepting.end() } }));
+
+	std::vector<std::shared_ptr<Match>> nodes(rules.nodes.size());
+	for (auto &node : nodes) node = std::make_shared<Match>();
+
+	std::vector<Match*> scans;
+	for (auto i = 0u; i < rules.nodes.size(); ++i) {
+		auto const& compiled = rules.nodes[i];
+		auto &node = i == 0 ? static_cast<Match&>(*this) : *nodes[i];
+
+		switch (compiled.kind) {
+		case compiled::Node::Kind::Empty:
+			break;
+		case compiled::Node::Kind::Keyword:
+			node.emplace<std::string>(compiled.text);
+			node.key = compiled.key;
+			node.ascii_key = compiled.ascii_key;
+			node.lemma = compiled.lemma;
+			for (auto rest = compiled.aliases; !rest.empty(); ) {
+				auto const key = rest.substr(0, rest.find('\037'));
+				rest.remove_prefix(key.size() + 1);
+				auto const ascii_key = rest.substr(0, rest.find('\037'));
+				rest.remove_prefix(ascii_key.size() + 1);
+				node.aliases.emplace_back(key, ascii_key);
+			}
+			break;
+		case compiled::Node::Kind::Pattern:
+			node.emplace<Pattern>(Pattern{ rules.patterns[compiled.pattern].source, dfas[compiled.pattern] });
+			break;
+		case compiled::Node::Kind::Stdin:
+			node.emplace<Candidates>(Candidates{ &stdin_lines });
+			stdin_used = true;
+			break;
+		case compiled::Node::Kind::Scan:
+			{
+				auto source = compiled.text;
+				node.scan_call = &compiled_values.emplace_back(lisp::read(source));
+				scans.push_back(&node);
+			}
+			break;
+		}
+
+		if (compiled.command_begin != compiled.command_end) {
+			auto &command = compiled_values.emplace_back(lisp::Value::list());
+			auto const args = rules.args.subspan(compiled.command_begin, compiled.command_end - compiled.command_begin);
+			auto const value_of = [](compiled::Arg const& arg) {
+				lisp::Value value;
+				value.kind = arg.kind;
+				value.str = arg.str;
+				value.num = arg.num;
+				return value;
+			};
+			for (auto arg = args.begin(); arg != args.end(); ++arg) {
+				if (arg->kind != lisp::Value::Kind::List) {
+					command.push_back(value_of(*arg));
+					continue;
+				}
+				// Elements of a (concat ...) follow it
+				auto &list = command.emplace_back(lisp::Value::list());
+				for (auto n = arg->num; n > 0; --n) list.push_back(value_of(*++arg));
+			}
+			node.command = &command;
+		}
+
+		for (auto c = compiled.children_begin; c < compiled.children_end; ++c)
+			node.next.push_back(nodes[rules.children[c]]);
+	}
+
+	std::vector<std::vector<File>> found(scans.size());
+	parallel_for(scans.size(), [&](std::size_t i) { found[i] = scan(*scans[i]->scan_call); });
+
+	for (auto i = 0u; i < scans.size(); ++i) {
+		auto &node = *scans[i];
+		auto const rest = std::move(node.next);
+		auto const command = std::exchange(node.command, nullptr);
+		node.next.clear();
+		node.scan_call = nullptr;
+		for (auto file : found[i]) {
+			auto child = node.put();
+			child->set(file);
+			child->next = rest;
+			child->command = command;
+		}
 	}
 }
 
 #ifdef Main
-int main(int, char **argv)
+// C++ string literal for sv, bytes outside of printable ASCII as octal
+// escapes, which unlike hex ones cannot swallow a following digit
+std::string literal(std::string_view sv)
+{
+	std::string out = "\"";
+	for (unsigned char c : sv) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		} else if (c < 0x20 || c >= 0x7f) {
+			char escape[5];
+			std::snprintf(escape, sizeof escape, "\\%03o", c);
+			out += escape;
+		} else {
+			out += c;
+		}
+	}
+	return out + '"';
+}
+
+// Prints the tree as tables for Suggestion_Tree::load. Nodes are numbered
+// breadth first, so the children of every node are one range.
+void compile(Match const& root, std::string_view rules_path)
+{
+	std::vector<Match const*> order{ &root };
+	std::unordered_map<Match const*, std::uint32_t> number{ { &root, 0 } };
+	for (auto i = 0u; i < order.size(); ++i)
+		for (auto const& child : order[i]->next)
+			if (number.try_emplace(child.get(), order.size()).second)
+				order.push_back(child.get());
+
+	std::vector<Dfa const*> dfas;
+	std::unordered_map<Dfa const*, std::uint32_t> dfa_number;
+	std::unordered_map<lisp::Value const*, std::pair<std::uint32_t, std::uint32_t>> command_args;
+	std::string nodes, children, args, patterns, tables;
+	std::uint32_t child_count = 0, arg_count = 0;
+
+	for (auto node : order) {
+		std::string kind = "Empty", text, key, ascii_key, lemma, aliases;
+		std::uint32_t pattern = 0;
+
+		if (auto x = std::get_if<std::string>(node)) {
+			kind = "Keyword", text = *x, key = node->key, ascii_key = node->ascii_key, lemma = node->lemma;
+			for (auto const& [alias, ascii_alias] : node->aliases)
+				aliases += alias + '\037' + ascii_alias + '\037';
+		} else if (auto x = std::get_if<Pattern>(node)) {
+			auto [it, inserted] = dfa_number.try_emplace(x->dfa.get(), dfas.size());
+			if (inserted) {
+				auto const& dfa = *x->dfa;
+				auto const name = "pattern_" + std::to_string(dfas.size());
+				dfas.push_back(x->dfa.get());
+
+				tables += "\tconstexpr Dfa::State " + name + "_table[] = {";
+				for (auto state : dfa.table) tables += " " + std::to_string(state) + ",";
+				tables += " };\n\tconstexpr bool " + name + "_accepting[] = {";
+				for (bool accepting : dfa.accepting) tables += accepting ? " true," : " false,";
+				tables += " };\n";
+
+				patterns += "\t\t{ " + literal(x->source) + ", " + std::to_string(dfa.start) + ", " + std::to_string(dfa.classes) + ", {";
+				for (auto cls : dfa.byte_class) patterns += " " + std::to_string(cls) + ",";
+				patterns += " }, " + name + "_table, " + name + "_accepting },\n";
+			}
+			kind = "Pattern", pattern = it->second;
+		} else if (std::get_if<Candidates>(node)) {
+			kind = "Stdin";
+		} else if (node->scan_call) {
+			kind = "Scan";
+			lisp::print(*node->scan_call, text);
+		} else {
+			ensure(std::get_if<std::monostate>(node), "Only scans can produce paths");
+		}
+
+		std::pair<std::uint32_t, std::uint32_t> command{};
+		if (node->command) {
+			auto [it, inserted] = command_args.try_emplace(node->command);
+			if (inserted) {
+				it->second.first = arg_count;
+				// (concat ...) is a List arg counting the args of its elements after it
+				auto const emit = [&](lisp::Value const& arg, auto const& emit) -> void {
+					ensure(arg.kind != lisp::Value::Kind::Nil, "Commands can only have strings, numbers, symbols and concat");
+					ensure(arg.kind != lisp::Value::Kind::List || arg.is_call_to("concat"), "Commands can only have strings, numbers, symbols and concat");
+					auto const arg_kind = arg.kind == lisp::Value::Kind::String ? "String" : arg.kind == lisp::Value::Kind::Number ? "Number"
+						: arg.kind == lisp::Value::Kind::List ? "List" : "Symbol";
+					auto const num = arg.kind == lisp::Value::Kind::Number ? arg.num : arg.kind == lisp::Value::Kind::List ? arg.size() : 0;
+					args += "\t\t{ lisp::Value::Kind::" + std::string(arg_kind) + ", " + literal(arg.str) + ", " + std::to_string(num) + " },\n";
+					++arg_count;
+					if (arg.kind == lisp::Value::Kind::List)
+						for (auto const& element : arg) {
+							ensure(element.kind != lisp::Value::Kind::List, "concat cannot be nested");
+							emit(element, emit);
+						}
+				};
+				for (auto const& arg : *node->command) emit(arg, emit);
+				it->second.second = arg_count;
+			}
+			command = it->second;
+		}
+
+		auto const children_begin = child_count;
+		for (auto const& child : node->next) {
+			children += " " + std::to_string(number.at(child.get())) + ",";
+			++child_count;
+		}
+
+		nodes += "\t\t{ Node::Kind::" + kind + ", " + literal(text) + ", " + literal(key) + ", " + literal(ascii_key) + ", " + literal(lemma) + ", " + literal(aliases) + ", "
+			+ std::to_string(pattern) + ", " + std::to_string(children_begin) + ", " + std::to_string(child_count) + ", "
+			+ std::to_string(command.first) + ", " + std::to_string(command.second) + " },\n";
+	}
+
+	std::cout << "// Generated from " << rules_path << " by `lisp -c`, do not edit\n"
+		<< "namespace compiled\n{\n"
+		<< tables
+		<< "\tconstexpr Node nodes[] = {\n" << nodes << "\t};\n";
+	if (child_count) std::cout << "\tconstexpr std::uint32_t children[] = {" << children << " };\n";
+	if (arg_count) std::cout << "\tconstexpr Arg args[] = {\n" << args << "\t};\n";
+	if (!dfas.empty()) std::cout << "\tconstexpr Pattern patterns[] = {\n" << patterns << "\t};\n";
+	std::cout << "\tconstexpr Rules rules{ nodes, "
+		<< (child_count ? "children" : "{}") << ", "
+		<< (arg_count ? "args" : "{}") << ", "
+		<< (dfas.empty() ? "{}" : "patterns") << " };\n"
+		<< "}" << std::endl;
+}
+
+// lisp rules.lisp     prints the tree for Graphviz
+// lisp -c rules.lisp  prints it as C++ tables, scans are left to startup
+int main(int, char **argv) try
 {
 	assert(*++argv);
+	bool const compiling = std::string_view(*argv) == "-c";
+	if (compiling) {
+		assert(*++argv);
+		defer_scans = true;
+	}
 
 	std::ifstream f(*argv);
+	ensure(bool(f), "Cannot open rules file");
 	std::string file{std::istreambuf_iterator<char>(f), {}};
 
 	std::string_view code{file};
@@ -502,6 +1353,11 @@ int main(int, char **argv)
 	Suggestion_Tree tree;
 	tree.eval(rules);
 	tree.optimize();
-	dump(tree);
+	if (compiling)
+		compile(tree, *argv);
+	else
+		dump(tree);
+} catch (std::exception const& e) {
+	fail(e);
 }
 #endif
@@ -5,8 +5,8 @@
 
 (action
 	((one-of "wyślij" "napisz") (one-of "wiadomość" "maila" "email") "do" match-email)
-	("thunderbird -compose \"to'" 4 "'\""))
+	("thunderbird" "-compose" (concat "to='" 4 "'")))
 
 (action
 	((one-of "otwórz" "edytuj") "skrypt" (find-all-executable "~/.local/bin"))
-	("alacritty -e vim " 3))
+	("alacritty" "-e" "vim" 3))
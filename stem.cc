@@ -0,0 +1,94 @@
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Light stemmer for Polish: strips the most common noun and adjective
+// endings so that inflected forms of a word ("maila", "maile", "mailem")
+// share one lemma ("mail"). Works on lowercase text without diacritics.
+namespace stem
+{
+	struct Rule
+	{
+		std::string_view suffix, replacement;
+	};
+
+	constexpr Rule rules[] = {
+		{ "osciami", "osc" }, { "osciach", "osc" }, { "osciom", "osc" }, { "oscia", "osc" }, { "osci", "osc" },
+		{ "iego", "i" }, { "iemu", "i" }, { "imi", "i" }, { "ich", "i" },
+		{ "ego", "" }, { "emu", "" }, { "ymi", "" }, { "ych", "" }, { "ej", "" },
+		{ "ami", "" }, { "ach", "" }, { "owi", "" }, { "om", "" }, { "ow", "" }, { "em", "" },
+		{ "a", "" }, { "e", "" }, { "i", "" }, { "o", "" }, { "u", "" }, { "y", "" },
+	};
+
+	// Shortest stem left after removing a suffix
+	constexpr std::size_t Min_Stem = 3;
+
+	// Rules are compiled into a trie of reversed suffixes, which the word is
+	// fed into from its last letter, so finding the longest matching suffix
+	// costs one step per letter of that suffix.
+	struct Node
+	{
+		char letter = 0;
+		std::uint8_t child = 0, sibling = 0;
+		std::int8_t rule = -1;
+	};
+
+	constexpr std::size_t trie_capacity()
+	{
+		std::size_t n = 1;
+		for (auto const& rule : rules) n += rule.suffix.size();
+		return n;
+	}
+
+	static_assert(trie_capacity() <= 256 && std::size(rules) <= 128, "Node indexes do not fit");
+
+	constexpr auto compile()
+	{
+		std::array<Node, trie_capacity()> trie{};
+		std::uint8_t used = 1;
+
+		for (auto r = 0u; r < std::size(rules); ++r) {
+			std::uint8_t at = 0;
+			for (auto it = rules[r].suffix.rbegin(); it != rules[r].suffix.rend(); ++it) {
+				auto child = trie[at].child;
+				while (child && trie[child].letter != *it) child = trie[child].sibling;
+				if (!child) {
+					child = used++;
+					trie[child].letter = *it;
+					trie[child].sibling = trie[at].child;
+					trie[at].child = child;
+				}
+				at = child;
+			}
+			trie[at].rule = r;
+		}
+
+		return trie;
+	}
+
+	constexpr auto trie = compile();
+
+	std::string stem(std::string_view word)
+	{
+		int rule = -1;
+		std::size_t cut = word.size();
+		std::uint8_t at = 0;
+
+		for (std::size_t i = 0; word.size() - i > Min_Stem; ) {
+			auto const letter = word[word.size() - ++i];
+			auto child = trie[at].child;
+			while (child && trie[child].letter != letter) child = trie[child].sibling;
+			if (!child) break;
+			at = child;
+			if (trie[at].rule >= 0) {
+				rule = trie[at].rule;
+				cut = word.size() - i;
+			}
+		}
+
+		auto result = std::string(word.substr(0, cut));
+		if (rule >= 0) result += rules[rule].replacement;
+		return result;
+	}
+}
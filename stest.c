@@ -1,53 +1,230 @@
 /* See LICENSE file for copyright and license details. */
+#ifdef __linux__
+#define _GNU_SOURCE /* statx */
+#include <sys/sysmacros.h>
+#endif
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 
 #include <dirent.h>
-#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "arg.h"
+#include "util.h"
 char *argv0;
 
 #define FLAG(x)  (flag[(x)-'a'])
 
-static void test(const char *, const char *);
-static void usage(void);
+/* Where names are looked up: a listed directory or the working directory.
+ * The mount flags of a listed directory are read once and hold for every
+ * entry on the same device. */
+struct dir {
+	int fd;
+	int mounted; /* dev and mountflags are known */
+	dev_t dev;
+	unsigned long mountflags;
+};
+
+/* Names that passed for one argument, one per line. With -q only whether
+ * one did. */
+struct out {
+	char *buf;
+	size_t len, size;
+	int matched;
+};
+
+static void test(const struct dir *, const char *, unsigned char, struct out *);
 
 static int match = 0;
 static int flag[26];
 static struct stat old, new;
 
+static unsigned int fields; /* statx mask of what the flags look at */
+
+static char **args;
+static struct out *outs;
+static int nargs, next;
+static int quit; /* -q found a match, workers stop taking arguments */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+emit(struct out *o, const char *name)
+{
+	size_t n = strlen(name);
+
+	if (FLAG('q') && !o)
+		exit(0);
+	if (FLAG('q')) {
+		o->matched = 1;
+		pthread_mutex_lock(&lock);
+		quit = 1;
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	if (!o) {
+		match = 1;
+		puts(name);
+		return;
+	}
+	if (o->len + n + 1 > o->size) {
+		o->size = (o->len + n + 1) * 2;
+		if (!(o->buf = realloc(o->buf, o->size))) {
+			perror("realloc");
+			exit(2);
+		}
+	}
+	memcpy(o->buf + o->len, name, n);
+	o->len += n;
+	o->buf[o->len++] = '\n';
+}
+
+/* stat(2) of name asking only for the fields the flags look at */
+static int
+getmeta(int fd, const char *name, int at, struct stat *st)
+{
+#ifdef STATX_TYPE
+	struct statx sx;
+
+	if (statx(fd, name, at, fields, &sx))
+		return -1;
+	st->st_dev = makedev(sx.stx_dev_major, sx.stx_dev_minor);
+	st->st_mode = sx.stx_mode;
+	st->st_uid = sx.stx_uid;
+	st->st_gid = sx.stx_gid;
+	st->st_size = sx.stx_size;
+	st->st_mtim.tv_sec = sx.stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = sx.stx_mtime.tv_nsec;
+	return 0;
+#else
+	return fstatat(fd, name, st, at);
+#endif
+}
+
+/* -r, -w and -x, the mount flags of a listed directory hold for its entries
+ * on the same device */
+static int
+allowed(const struct dir *d, const char *name, const struct stat *st, int amode)
+{
+	return canaccess(d->fd, name, st, amode,
+	                 d->mounted && st->st_dev == d->dev ? &d->mountflags : NULL);
+}
+
+/* type is the d_type of a listed entry, DT_UNKNOWN when not known */
 static void
-test(const char *path, const char *name)
+test(const struct dir *d, const char *name, unsigned char type, struct out *o)
 {
 	struct stat st, ln;
 
-	if ((!stat(path, &st) && (FLAG('a') || name[0] != '.')        /* hidden files      */
+	/* stat succeeding is all -e asks for */
+	if (((FLAG('a') || name[0] != '.')                            /* hidden files      */
+	&& !getmeta(d->fd, name, 0, &st)
 	&& (!FLAG('b') || S_ISBLK(st.st_mode))                        /* block special     */
 	&& (!FLAG('c') || S_ISCHR(st.st_mode))                        /* character special */
 	&& (!FLAG('d') || S_ISDIR(st.st_mode))                        /* directory         */
-	&& (!FLAG('e') || access(path, F_OK) == 0)                    /* exists            */
 	&& (!FLAG('f') || S_ISREG(st.st_mode))                        /* regular file      */
 	&& (!FLAG('g') || st.st_mode & S_ISGID)                       /* set-group-id flag */
-	&& (!FLAG('h') || (!lstat(path, &ln) && S_ISLNK(ln.st_mode))) /* symbolic link     */
+	&& (!FLAG('h') || (type != DT_UNKNOWN ? type == DT_LNK :      /* symbolic link     */
+	    !getmeta(d->fd, name, AT_SYMLINK_NOFOLLOW, &ln) && S_ISLNK(ln.st_mode)))
 	&& (!FLAG('n') || st.st_mtime > new.st_mtime)                 /* newer than file   */
 	&& (!FLAG('o') || st.st_mtime < old.st_mtime)                 /* older than file   */
 	&& (!FLAG('p') || S_ISFIFO(st.st_mode))                       /* named pipe        */
-	&& (!FLAG('r') || access(path, R_OK) == 0)                    /* readable          */
+	&& (!FLAG('r') || allowed(d, name, &st, R_OK))                /* readable          */
 	&& (!FLAG('s') || st.st_size > 0)                             /* not empty         */
 	&& (!FLAG('u') || st.st_mode & S_ISUID)                       /* set-user-id flag  */
-	&& (!FLAG('w') || access(path, W_OK) == 0)                    /* writable          */
-	&& (!FLAG('x') || access(path, X_OK) == 0)) != FLAG('v')) {   /* executable        */
-		if (FLAG('q'))
-			exit(0);
-		match = 1;
-		puts(name);
+	&& (!FLAG('w') || allowed(d, name, &st, W_OK))                /* writable          */
+	&& (!FLAG('x') || allowed(d, name, &st, X_OK))) != FLAG('v')) /* executable        */
+		emit(o, name);
+}
+
+/* Tests arg, or its entries with -l */
+static void
+testarg(const char *arg, struct out *o)
+{
+	struct dir d = { AT_FDCWD, 0, 0, 0 };
+	struct statvfs vfs;
+	struct stat st;
+	struct dirent *e;
+	DIR *dir;
+
+	if (!FLAG('l') || !(dir = opendir(arg))) {
+		test(&d, arg, DT_UNKNOWN, o);
+		return;
+	}
+	d.fd = dirfd(dir);
+	if (!fstat(d.fd, &st) && !fstatvfs(d.fd, &vfs)) {
+		d.mounted = 1;
+		d.dev = st.st_dev;
+		d.mountflags = vfs.f_flag;
+	}
+	while (!o->matched && (e = readdir(dir)))
+		test(&d, e->d_name, e->d_type, o);
+	closedir(dir);
+}
+
+static void *
+work(void *unused)
+{
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		i = quit ? nargs : next++;
+		pthread_mutex_unlock(&lock);
+		if (i >= nargs)
+			return NULL;
+		testarg(args[i], &outs[i]);
 	}
 }
 
+/* Tests all arguments on up to one thread per processor, outs[i] holds what
+ * passed for argv[i] */
+static void
+scan(char **argv, int argc)
+{
+	pthread_t *threads;
+	long i, n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	args = argv;
+	nargs = argc;
+	next = 0;
+	if (!(outs = calloc(argc, sizeof *outs)) ||
+	    !(threads = calloc(argc, sizeof *threads))) {
+		perror("calloc");
+		exit(2);
+	}
+	if (n < 1)
+		n = 1;
+	if (n > argc)
+		n = argc;
+	for (i = 1; i < n; i++)
+		if (pthread_create(&threads[i], NULL, work, NULL))
+			n = i;
+	work(NULL);
+	for (i = 1; i < n; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
+
+static void
+setup(void)
+{
+#ifdef STATX_TYPE
+	fields = STATX_TYPE | STATX_MODE;
+	if (FLAG('r') || FLAG('w') || FLAG('x'))
+		fields |= STATX_UID;
+	if (FLAG('n') || FLAG('o'))
+		fields |= STATX_MTIME;
+	if (FLAG('s'))
+		fields |= STATX_SIZE;
+#endif
+}
+
+#ifndef Bench
 static void
 usage(void)
 {
@@ -59,12 +236,11 @@ usage(void)
 int
 main(int argc, char *argv[])
 {
-	struct dirent *d;
-	char path[PATH_MAX], *line = NULL, *file;
+	struct dir cwd = { AT_FDCWD, 0, 0, 0 };
+	char *line = NULL, *file;
 	size_t linesiz = 0;
 	ssize_t n;
-	DIR *dir;
-	int r;
+	int i;
 
 	ARGBEGIN {
 	case 'n': /* newer than file */
@@ -81,29 +257,133 @@ main(int argc, char *argv[])
 			usage(); /* unknown flag */
 	} ARGEND;
 
+	setup();
 	if (!argc) {
 		/* read list from stdin */
 		while ((n = getline(&line, &linesiz, stdin)) > 0) {
 			if (line[n - 1] == '\n')
 				line[n - 1] = '\0';
-			test(line, line);
+			test(&cwd, line, DT_UNKNOWN, NULL);
 		}
 		free(line);
 	} else {
-		for (; argc; argc--, argv++) {
-			if (FLAG('l') && (dir = opendir(*argv))) {
-				/* test directory contents */
-				while ((d = readdir(dir))) {
-					r = snprintf(path, sizeof path, "%s/%s",
-					             *argv, d->d_name);
-					if (r >= 0 && (size_t)r < sizeof path)
-						test(path, d->d_name);
-				}
-				closedir(dir);
+		scan(argv, argc);
+		if (quit)
+			return 0;
+		for (i = 0; i < argc; i++) {
+			fwrite(outs[i].buf, 1, outs[i].len, stdout);
+			match |= outs[i].len > 0;
+		}
+	}
+	return match ? 0 : 1;
+}
+#else
+#include <ftw.h>
+#include <time.h>
+
+#define DIRS     100
+#define ENTRIES  1000
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* What stest -flx did before: stat(2) and access(2) per file, one
+ * directory after the other */
+static size_t
+perfile(char **dirs, int n)
+{
+	struct dirent *e;
+	struct stat st;
+	char path[4096];
+	size_t found = 0;
+	DIR *dir;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (!(dir = opendir(dirs[i])))
+			continue;
+		while ((e = readdir(dir))) {
+			snprintf(path, sizeof path, "%s/%s", dirs[i], e->d_name);
+			found += !stat(path, &st) && e->d_name[0] != '.' &&
+			         S_ISREG(st.st_mode) && access(path, X_OK) == 0;
+		}
+		closedir(dir);
+	}
+	return found;
+}
+
+static int
+removeentry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+	return remove(path);
+}
+
+/* stest -flx over a synthetic $PATH of DIRS directories with ENTRIES
+ * entries each: executables, plain files, hidden files and symlinks */
+int
+main(void)
+{
+	char root[] = "/tmp/stest-bench.XXXXXX", path[4096], target[4096];
+	char *dirs[DIRS];
+	double t, before = 0, after = 0;
+	size_t found = 0, passed = 0;
+	int i, j, k, fd;
+
+	if (!mkdtemp(root)) {
+		perror("mkdtemp");
+		return 2;
+	}
+	for (i = 0; i < DIRS; i++) {
+		snprintf(path, sizeof path, "%s/bin%d", root, i);
+		if (mkdir(path, 0755) || !(dirs[i] = strdup(path))) {
+			perror(path);
+			return 2;
+		}
+		for (j = 0; j < ENTRIES; j++) {
+			snprintf(path, sizeof path, "%s/%s%d", dirs[i], j % 4 == 2 ? "." : "", j);
+			if (j % 4 == 3) {
+				snprintf(target, sizeof target, "%s/%d", dirs[i], j - 3);
+				if (symlink(target, path))
+					perror(path);
+			} else if ((fd = open(path, O_WRONLY | O_CREAT, j % 4 == 1 ? 0644 : 0755)) < 0) {
+				perror(path);
 			} else {
-				test(*argv, *argv);
+				close(fd);
 			}
 		}
 	}
-	return match ? 0 : 1;
+
+	FLAG('f') = FLAG('l') = FLAG('x') = 1;
+	setup();
+	for (k = 0; k < 5; k++) {
+		t = now();
+		found = perfile(dirs, DIRS);
+		t = now() - t;
+		before = k && before < t ? before : t;
+
+		t = now();
+		scan(dirs, DIRS);
+		t = now() - t;
+		after = k && after < t ? after : t;
+
+		for (passed = 0, i = 0; i < DIRS; i++) {
+			for (j = 0; j < (int)outs[i].len; j++)
+				passed += outs[i].buf[j] == '\n';
+			free(outs[i].buf);
+		}
+		free(outs);
+	}
+	printf("%d entries, best of %d\n", DIRS * ENTRIES, k);
+	printf("stat and access per file: %8.2f ms, %zu executables\n", before, found);
+	printf("statx scan engine:        %8.2f ms, %zu executables\n", after, passed);
+
+	nftw(root, removeentry, 16, FTW_DEPTH | FTW_PHYS);
+	return found != passed;
 }
+#endif
@@ -0,0 +1,94 @@
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Trigram index for substring search over many keys. Every trigram of a key
+// has a posting list of the ids of keys containing it, in ascending order,
+// stored as varint encoded deltas. A query intersects the lists of the
+// trigrams of its tokens, candidates still have to be verified.
+struct Trigram_Index
+{
+	struct Posting
+	{
+		std::vector<std::uint8_t> bytes;
+		std::uint32_t last = 0, count = 0;
+	};
+
+	std::unordered_map<std::uint32_t, Posting> postings;
+	std::uint32_t entries = 0;
+
+	static constexpr std::uint32_t trigram(std::string_view sv, std::size_t i)
+	{
+		return std::uint32_t(std::uint8_t(sv[i])) << 16 | std::uint32_t(std::uint8_t(sv[i+1])) << 8 | std::uint8_t(sv[i+2]);
+	}
+
+	// Ids have to be added in ascending order, one key can be added more than once
+	void add(std::uint32_t id, std::string_view key)
+	{
+		entries = std::max(entries, id + 1);
+		for (std::size_t i = 0; i + 3 <= key.size(); ++i) {
+			auto &posting = postings[trigram(key, i)];
+			if (posting.count && posting.last == id) continue;
+
+			auto delta = posting.count ? id - posting.last : id;
+			for (; delta >= 0x80; delta >>= 7) posting.bytes.push_back(delta | 0x80);
+			posting.bytes.push_back(delta);
+			posting.last = id;
+			++posting.count;
+		}
+	}
+
+	static std::vector<std::uint32_t> decode(Posting const& posting)
+	{
+		std::vector<std::uint32_t> ids;
+		ids.reserve(posting.count);
+		std::uint32_t id = 0, delta = 0;
+		unsigned shift = 0;
+		for (auto byte : posting.bytes) {
+			delta |= std::uint32_t(byte & 0x7f) << shift;
+			shift += 7;
+			if (byte & 0x80) continue;
+			id += delta;
+			ids.push_back(id);
+			delta = shift = 0;
+		}
+		return ids;
+	}
+
+	// Ids of keys that may contain every token, nullopt when no token is long
+	// enough to have a trigram and everything has to be scanned
+	template<typename Tokens>
+	std::optional<std::vector<std::uint32_t>> candidates(Tokens const& tokens) const
+	{
+		std::vector<Posting const*> lists;
+		for (std::string_view token : tokens) {
+			for (std::size_t i = 0; i + 3 <= token.size(); ++i) {
+				auto it = postings.find(trigram(token, i));
+				if (it == postings.end()) return std::vector<std::uint32_t>{};
+				lists.push_back(&it->second);
+			}
+		}
+		if (lists.empty()) return std::nullopt;
+
+		std::sort(lists.begin(), lists.end(), [](auto a, auto b) {
+			return a->count != b->count ? a->count < b->count : std::less<>{}(a, b);
+		});
+		lists.erase(std::unique(lists.begin(), lists.end()), lists.end());
+
+		// Trigrams common to most keys do not narrow anything down, decoding
+		// lists much longer than the candidates left costs more than verifying them
+		if (lists.front()->count > entries / 2) return std::nullopt;
+		auto ids = decode(*lists.front());
+		for (auto it = std::next(lists.begin()); it != lists.end() && (*it)->count < 8 * ids.size(); ++it) {
+			auto const other = decode(**it);
+			std::vector<std::uint32_t> both;
+			std::set_intersection(ids.begin(), ids.end(), other.begin(), other.end(), std::back_inserter(both));
+			ids = std::move(both);
+		}
+		return ids;
+	}
+};
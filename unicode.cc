@@ -1,27 +1,156 @@
+#include <cstdint>
 #include <string>
 #include <string_view>
 
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include "casefold.h"
+
 namespace utf8
 {
-	// TODO Only supports ASCII & Polish letters
+	// Upper bound of the bytes to_lower writes for n bytes of input.
+	// Lowercasing grows a character by at most one byte and never grows
+	// ASCII, checked when casefold.h is generated.
+	constexpr std::size_t lower_capacity(std::size_t n) { return n + n / 2; }
+
+	constexpr char32_t lower(char32_t c)
+	{
+		return c + casefold::stage2[casefold::stage1[c >> 8]][c & 0xff];
+	}
+
+	// Decodes codepoint at the start of sv. Returns its length, or 0 when sv
+	// does not start with a valid, shortest form UTF-8 sequence.
+	constexpr unsigned decode(std::string_view sv, char32_t &c)
+	{
+		auto const b = static_cast<unsigned char>(sv.front());
+		unsigned len = b < 0x80 ? 1 : b < 0xc2 ? 0 : b < 0xe0 ? 2 : b < 0xf0 ? 3 : b < 0xf5 ? 4 : 0;
+		if (len == 0 || len > sv.size()) return 0;
+
+		c = len == 1 ? b : b & (0x7f >> len);
+		for (unsigned i = 1; i < len; ++i) {
+			auto const cont = static_cast<unsigned char>(sv[i]);
+			if ((cont & 0xc0) != 0x80) return 0;
+			c = (c << 6) | (cont & 0x3f);
+		}
+
+		if ((len == 3 && (c < 0x800 || (c >= 0xd800 && c < 0xe000))) || (len == 4 && (c < 0x10000 || c > 0x10ffff)))
+			return 0;
+		return len;
+	}
+
+	inline char* encode(char32_t c, char *out)
+	{
+		if (c < 0x80) {
+			*out++ = c;
+		} else if (c < 0x800) {
+			*out++ = 0xc0 | (c >> 6);
+			*out++ = 0x80 | (c & 0x3f);
+		} else if (c < 0x10000) {
+			*out++ = 0xe0 | (c >> 12);
+			*out++ = 0x80 | ((c >> 6) & 0x3f);
+			*out++ = 0x80 | (c & 0x3f);
+		} else {
+			*out++ = 0xf0 | (c >> 18);
+			*out++ = 0x80 | ((c >> 12) & 0x3f);
+			*out++ = 0x80 | ((c >> 6) & 0x3f);
+			*out++ = 0x80 | (c & 0x3f);
+		}
+		return out;
+	}
+
+	// Lowercases sv into out, which must hold lower_capacity(sv.size()) bytes.
+	// Returns number of bytes written. Invalid sequences are copied unchanged.
+	inline std::size_t to_lower(std::string_view sv, char *out)
+	{
+		auto const begin = out;
+
+		while (!sv.empty()) {
+#ifdef __AVX2__
+			for (; sv.size() >= 32; sv.remove_prefix(32), out += 32) {
+				auto v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(sv.data()));
+				if (_mm256_movemask_epi8(v)) break;
+				// Shift 'A'..'Z' to the bottom of signed range, so single compare finds them
+				auto upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(-128 + 26), _mm256_add_epi8(v, _mm256_set1_epi8(0x80 - 'A')));
+				v = _mm256_add_epi8(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(out), v);
+			}
+#endif
+#ifdef __SSE2__
+			for (; sv.size() >= 16; sv.remove_prefix(16), out += 16) {
+				auto v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(sv.data()));
+				if (_mm_movemask_epi8(v)) break;
+				auto upper = _mm_cmplt_epi8(_mm_add_epi8(v, _mm_set1_epi8(0x80 - 'A')), _mm_set1_epi8(-128 + 26));
+				v = _mm_add_epi8(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(out), v);
+			}
+#endif
+			if (sv.empty()) break;
+
+			if (auto const b = static_cast<unsigned char>(sv.front()); b < 0x80) {
+				*out++ = b >= 'A' && b <= 'Z' ? b + 0x20 : b;
+				sv.remove_prefix(1);
+				continue;
+			}
+
+			char32_t c;
+			if (auto len = decode(sv, c)) {
+				out = encode(lower(c), out);
+				sv.remove_prefix(len);
+			} else {
+				*out++ = sv.front();
+				sv.remove_prefix(1);
+			}
+		}
+
+		return out - begin;
+	}
+
 	std::string to_lower(std::string_view sv)
 	{
-		static constexpr std::string_view multibyte_lower[] = { "ą", "ę", "ó", "ń", "ł", "ó", "ź", "ż", "ć", "ś" };
-		static constexpr std::string_view multibyte_upper[] = { "Ą", "Ę", "Ó", "Ń", "Ł", "Ó", "Ź", "Ż", "Ć", "Ś" };
+		std::string result(lower_capacity(sv.size()), '\0');
+		result.resize(to_lower(sv, result.data()));
+		return result;
+	}
+
+	// Base letters of U+00C0..U+017F (Latin-1 Supplement and Latin Extended-A),
+	// '.' where there is none
+	constexpr std::string_view latin_base =
+		"aaaaaa.ceeeeiiiidnooooo.ouuuuy.."
+		"aaaaaa.ceeeeiiiidnooooo.ouuuuy.y"
+		"aaaaaaccccccccddddeeeeeeeeeegggg"
+		"gggghhhhiiiiiiiiii..jjkk.lllllll"
+		"lllnnnnnnnnnoooooo..rrrrrrssssss"
+		"ssttttttuuuuuuuuuuuuwwyyyzzzzzzs";
+
+	// Replaces Latin letters with diacritics by their base letter, so "źdźbło"
+	// becomes "zdzblo". Writes at most sv.size() bytes into out, returns count.
+	inline std::size_t strip_diacritics(std::string_view sv, char *out)
+	{
+		auto const begin = out;
 
-		std::string result;
-next:
 		while (!sv.empty()) {
-			for (auto i = 0u; i < std::size(multibyte_lower); ++i) {
-				if (sv.starts_with(multibyte_upper[i])) {
-					sv.remove_prefix(multibyte_upper[i].size());
-					result += multibyte_lower[i];
-					goto next;
+			auto const b = static_cast<unsigned char>(sv.front());
+			if (b >= 0xc3 && b <= 0xc5 && sv.size() >= 2 && (sv[1] & 0xc0) == 0x80) {
+				auto const base = latin_base[((b & 0x1f) << 6 | (sv[1] & 0x3f)) - 0xc0];
+				if (base != '.') {
+					*out++ = base;
+					sv.remove_prefix(2);
+					continue;
 				}
 			}
-			result += std::tolower(sv.front());
+			*out++ = sv.front();
 			sv.remove_prefix(1);
 		}
+
+		return out - begin;
+	}
+
+	std::string strip_diacritics(std::string_view sv)
+	{
+		std::string result(sv.size(), '\0');
+		result.resize(strip_diacritics(sv, result.data()));
 		return result;
 	}
 
@@ -0,0 +1,178 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Frecency of chosen suggestions. Every choice is appended to the usage log
+// as one fixed size record, so a crash can only leave a torn last record,
+// which is ignored. The log is read through mmap at startup and folded into
+// scores that decay with age. Once it grows past Max_Records it is rewritten
+// with one record per key, keeping only the Max_Keys most used ones.
+namespace usage
+{
+	struct Record
+	{
+		std::uint64_t key;
+		std::uint32_t time;
+		float weight;
+	};
+
+	static_assert(sizeof(Record) == 16, "Record layout is the file format");
+
+	constexpr double Half_Life = 14 * 24 * 60 * 60;
+	constexpr std::size_t Max_Records = 4096;
+	constexpr std::size_t Max_Keys = 1024;
+	constexpr float Min_Weight = 0.01;
+
+	std::string log_path;
+	std::size_t records = 0;
+	std::uint32_t now = 0;
+	std::unordered_map<std::uint64_t, float> scores;
+
+	// FNV-1a, keys are hashes of the values along the chosen path
+	constexpr std::uint64_t hash(std::string_view sv, std::uint64_t h = 14695981039346656037ull)
+	{
+		for (unsigned char c : sv) {
+			h ^= c;
+			h *= 1099511628211ull;
+		}
+		return h;
+	}
+
+	float decayed(Record const& r)
+	{
+		double const age = r.time < now ? double(now - r.time) : 0.0;
+		// Logs compacted while the decay overflowed hold infinite weights
+		float const weight = std::isfinite(r.weight) ? r.weight : 1;
+		return weight * std::exp2(-age / Half_Life);
+	}
+
+	float score(std::uint64_t key)
+	{
+		auto it = scores.find(key);
+		return it == scores.end() ? 0 : it->second;
+	}
+
+	void compact()
+	{
+		std::vector<Record> kept;
+		for (auto [key, weight] : scores)
+			if (weight >= Min_Weight)
+				kept.push_back({ key, now, weight });
+
+		if (kept.size() > Max_Keys) {
+			std::nth_element(kept.begin(), kept.begin() + Max_Keys, kept.end(),
+				[](Record const& a, Record const& b) { return a.weight > b.weight; });
+			kept.resize(Max_Keys);
+		}
+
+		auto const tmp = log_path + ".tmp";
+		int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) return;
+		auto const size = kept.size() * sizeof(Record);
+		// On disk before the rename, or a crash could leave the log empty
+		bool const written = write(fd, kept.data(), size) == ssize_t(size) && fsync(fd) == 0;
+		if (close(fd) == 0 && written && rename(tmp.c_str(), log_path.c_str()) == 0)
+			records = kept.size();
+		else
+			unlink(tmp.c_str());
+	}
+
+	void load(std::string path)
+	{
+		log_path = std::move(path);
+		now = std::time(nullptr);
+		scores.clear();
+		records = 0;
+
+		int fd = open(log_path.c_str(), O_RDONLY);
+		if (fd < 0) return;
+
+		bool torn = false;
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			records = st.st_size / sizeof(Record);
+			torn = st.st_size % sizeof(Record) != 0;
+			if (auto p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0); p != MAP_FAILED) {
+				auto const log = static_cast<Record const*>(p);
+				for (std::size_t i = 0; i < records; ++i)
+					scores[log[i].key] += decayed(log[i]);
+				munmap(p, st.st_size);
+			}
+		}
+		close(fd);
+
+		// Appending after a torn record would misalign the rest of the log
+		if (torn || records > Max_Records)
+			compact();
+	}
+
+	void record(std::uint64_t key)
+	{
+		if (log_path.empty()) return;
+
+		now = std::time(nullptr);
+		Record const r{ key, now, 1 };
+		scores[key] += 1;
+
+		int fd = open(log_path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+		if (fd < 0) return;
+		if (write(fd, &r, sizeof(r)) == ssize_t(sizeof(r)))
+			++records;
+		close(fd);
+
+		if (records > Max_Records)
+			compact();
+	}
+}
+
+#ifdef Test
+#include <cstdio>
+#include <cstdlib>
+
+// make test: decay of single records and of a log read back by load
+int main()
+{
+	int failed = 0;
+	auto const check = [&](char const* what, double got, double want) {
+		if (std::isfinite(got) && std::abs(got - want) <= want * 1e-4) return;
+		std::printf("FAIL %s: %g, expected %g\n", what, got, want);
+		failed = 1;
+	};
+
+	usage::now = 100'000'000;
+	auto const ago = [](double seconds) { return usage::Record{ 1, std::uint32_t(usage::now - seconds), 2 }; };
+	check("now", usage::decayed(ago(0)), 2);
+	check("a minute ago", usage::decayed(ago(60)), 2 * std::exp2(-60 / usage::Half_Life));
+	check("one half-life ago", usage::decayed(ago(usage::Half_Life)), 1);
+	check("two half-lives ago", usage::decayed(ago(2 * usage::Half_Life)), 0.5);
+	check("in the future", usage::decayed({ 1, usage::now + 60, 2 }), 2);
+	check("infinite weight", usage::decayed({ 1, usage::now, INFINITY }), 1);
+
+	char path[] = "/tmp/usage-test.XXXXXX";
+	int fd = mkstemp(path);
+	auto const t = std::uint32_t(std::time(nullptr));
+	usage::Record const log[] = { { 7, t, 1 }, { 7, std::uint32_t(t - usage::Half_Life), 1 }, { 8, t - 60, 1 } };
+	if (fd < 0 || write(fd, log, sizeof log) != ssize_t(sizeof log)) {
+		std::perror(path);
+		return 2;
+	}
+	close(fd);
+	usage::load(path);
+	check("loaded twice chosen", usage::score(7), 1.5);
+	check("loaded once chosen", usage::score(8), 1);
+	unlink(path);
+
+	if (!failed) std::puts("usage: ok");
+	return failed;
+}
+#endif
@@ -1,8 +1,15 @@
 /* See LICENSE file for copyright and license details. */
+#ifdef __linux__
+#define _GNU_SOURCE /* ST_NOEXEC */
+#endif
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
 
 #include "util.h"
 
@@ -33,3 +40,61 @@ die(const char *fmt, ...) {
 
 	exit(1);
 }
+
+/* Path of a file in the nlp-menu cache directory, which is created if
+ * missing. The caller has to call free(3) on the returned path. */
+char *
+cachepath(const char *name)
+{
+	const char *dir = getenv("XDG_CACHE_HOME"), *sub = "/nlp-menu/";
+	char *path, *p;
+	size_t len;
+
+	if (!dir || !*dir) {
+		if (!(dir = getenv("HOME")))
+			return NULL;
+		sub = "/.cache/nlp-menu/";
+	}
+	len = strlen(dir) + strlen(sub) + strlen(name) + 1;
+	path = ecalloc(len, 1);
+	snprintf(path, len, "%s%s", dir, sub);
+	for (p = path + 1; (p = strchr(p, '/')); *p++ = '/') {
+		*p = '\0';
+		mkdir(path, 0755);
+	}
+	strcat(path, name);
+	return path;
+}
+
+/* access(2) of the real user for name in the directory fd, whose stat(2)
+ * is st. Only a grant by the owner's bits to the owner is taken from the
+ * mode bits, to write or execute together with mountflags, the statvfs(3)
+ * flags of its mount, NULL when not known. Group and other bits, which
+ * ACLs may override, and denials that root or a capability may override
+ * are left to faccessat(2). */
+int
+canaccess(int fd, const char *name, const struct stat *st, int amode,
+          const unsigned long *mountflags)
+{
+	mode_t bits = amode == R_OK ? S_IRUSR : amode == W_OK ? S_IWUSR : S_IXUSR;
+
+	if (st->st_uid != getuid() || !(st->st_mode & bits) ||
+	    (amode != R_OK && !mountflags))
+		return faccessat(fd, name, amode, 0) == 0;
+	if (amode == R_OK)
+		return 1;
+	if (amode == W_OK)
+		return !(*mountflags & ST_RDONLY);
+	return S_ISDIR(st->st_mode) || !(*mountflags & ST_NOEXEC);
+}
+
+/* Regular file in the directory fd we may run, not hidden: what stest -flx
+ * lists for dmenu_path */
+int
+isexecutable(int fd, const char *name)
+{
+	struct stat st;
+
+	return name[0] != '.' && !fstatat(fd, name, &st, 0) &&
+	       S_ISREG(st.st_mode) && canaccess(fd, name, &st, X_OK, NULL);
+}
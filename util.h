@@ -6,3 +6,8 @@
 
 void die(const char *fmt, ...);
 void *ecalloc(size_t nmemb, size_t size);
+char *cachepath(const char *name);
+struct stat;
+int canaccess(int fd, const char *name, const struct stat *st, int amode,
+              const unsigned long *mountflags);
+int isexecutable(int fd, const char *name);